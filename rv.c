@@ -64,16 +64,115 @@ static rv_u32 rv_lr(rv *cpu, rv_u8 i) { return cpu->r[i]; }
 /* store register */
 static void rv_sr(rv *cpu, rv_u8 i, rv_u32 v) { cpu->r[i] = i ? v : 0; }
 
+#ifdef RV_STATS
+#define rv_stat(f, n) (cpu->stats.f += (n)) /* add n to statistic f */
+#else
+#define rv_stat(f, n) (void)0 /* compiled out */
+#endif
+
+#ifdef RV_TRACE
+#ifndef __GNUC__
+#error "RV_TRACE requires GNU C atomics"
+#endif
+/* records in the trace ring the consumer has yet to take */
+#define rv_tracelen(cpu)                                                       \
+  ((cpu)->trace.head - __atomic_load_n(&(cpu)->trace.tail, __ATOMIC_ACQUIRE))
+/* stop before an instruction unless it and a trap both fit in the ring */
+#define rv_tracefull(cpu)                                                      \
+  ((cpu)->trace.rec && rv_tracelen(cpu) >= (cpu)->trace.mask)
+#define rv_traceva(v) (cpu->trace.va = (v)) /* data address of this record */
+
+/* append a record to the trace ring, if tracing and there is room */
+static void rv_rec(rv *cpu, rv_u32 pc, rv_u32 inst, rv_u32 rd, rv_u32 addr) {
+  rv_trace_rec *r;
+  if (!cpu->trace.rec || rv_tracelen(cpu) > cpu->trace.mask)
+    return;
+  r = cpu->trace.rec + (cpu->trace.head & cpu->trace.mask);
+  r->pc = pc, r->inst = inst, r->rd = rd, r->addr = addr;
+  __atomic_store_n(&cpu->trace.head, cpu->trace.head + 1, __ATOMIC_RELEASE);
+  cpu->trace.va = 0;
+}
+#else
+#define rv_tracefull(cpu) 0                     /* compiled out */
+#define rv_traceva(v) (void)0                   /* compiled out */
+#define rv_rec(cpu, pc, inst, rd, addr) (void)0 /* compiled out */
+#endif
+
+/* record the instruction u, which is retiring */
+#define rv_recu(u)                                                             \
+  rv_rec(cpu, cpu->pc, rv_isz((u)->raw) < 4 ? (u)->raw & 0xFFFF : (u)->raw,    \
+         cpu->r[(u)->rd], cpu->trace.va)
+
 #define RV_CSR(num, r, w, dst) /* check if we are accessing csr `num` */       \
   y = ((csr == (num)) ? (rm = r, wm = w, &cpu->csr.dst) : y)
 
+#define RV_TLB_VA 1   /* flush entries for one address */
+#define RV_TLB_ASID 2 /* flush non-global entries for one asid */
+
+/* flush TLB entries selected by `sel` (or all entries if `sel` is 0) */
+static void rv_tlbflush(rv *cpu, rv_u32 va, rv_u32 asid, rv_u32 sel) {
+  rv_u32 x, vpn = va >> 12;
+  rv_tlb *t = cpu->itlb;
+  for (x = 0; x < 2 * RV_TLB_SIZE; x++, t++) {
+    if (x == RV_TLB_SIZE)
+      t = cpu->dtlb; /* continue with data tlb */
+    if ((sel & RV_TLB_VA) && t->va >> 12 != vpn &&
+        !(t->i && t->va >> 22 == vpn >> 10)) /* megapages cover 4MiB */
+      continue;
+    if ((sel & RV_TLB_ASID) && (t->asid != asid || rv_b(t->pte, 5)))
+      continue;
+    t->va = 0;
+  }
+}
+
+rv_res rv_map_ram(rv *cpu, rv_u32 base, rv_u32 size, rv_u8 *host) {
+  rv_u32 x;
+  for (x = 0; x < RV_RAM_REGIONS; x++)
+    if (!cpu->ram[x]) {
+      cpu->ram_base[x] = base, cpu->ram_size[x] = size, cpu->ram[x] = host;
+      rv_tlbflush(cpu, 0, 0, 0); /* cached host pointers are stale */
+      return RV_OK;
+    }
+  return RV_BAD;
+}
+
+/* host pointer to physical address pa if it is ram, otherwise NULL */
+static rv_u8 *rv_ram(rv *cpu, rv_u32 pa) {
+  rv_u32 x;
+  for (x = 0; x < RV_RAM_REGIONS; x++)
+    if (pa - cpu->ram_base[x] < cpu->ram_size[x])
+      return cpu->ram[x] + (pa - cpu->ram_base[x]);
+  return NULL;
+}
+
+/* advance the block generation, dropping all block links */
+static void rv_blkgen(rv *cpu) {
+  rv_u32 x;
+  if ((cpu->blk_gen += 8))
+    return;
+  for (x = 0; x < RV_BLOCKS; x++) /* wrapped around, old links look valid */
+    cpu->blk[x].link_tag[0] = cpu->blk[x].link_tag[1] = 0;
+  cpu->blk_rtag = 0;
+}
+
+/* with sstc enabled (menvcfg.stce), stip is raised by time >= stimecmp */
+static void rv_sstc(rv *cpu) {
+  rv_u32 stip = cpu->csr.mtimeh > cpu->csr.stimecmph ||
+                (cpu->csr.mtimeh == cpu->csr.stimecmph &&
+                 cpu->csr.mtime >= cpu->csr.stimecmp);
+  if (rv_b(cpu->csr.menvcfgh, 31))
+    cpu->csr.mip = (cpu->csr.mip & ~(rv_u32)32) | stip << 5;
+}
+
 /* csr bus access -- we model csrs as an internal memory bus */
 static rv_res rv_csr_bus(rv *cpu, rv_u32 csr, rv_u32 w, rv_u32 *io) {
   rv_u32 *y = NULL /* phys. register */, wm /* writable bits */ = -1U, rm = -1U;
   rv_u32 rw = rv_bf(csr, 11, 10), priv = rv_bf(csr, 9, 8);
   if ((w && rw == 3) || cpu->priv < priv ||
-      (csr == 0x180 && cpu->priv == RV_PSUPER && rv_b(cpu->csr.mstatus, 20)))
-    return RV_BAD; /* invalid access OR writing to satp with tvm=1 */
+      (csr == 0x180 && cpu->priv == RV_PSUPER && rv_b(cpu->csr.mstatus, 20)) ||
+      ((csr & ~0x10U) == 0x14D && cpu->priv < RV_PMACH &&
+       !rv_b(cpu->csr.menvcfgh, 31)))
+    return RV_BAD; /* invalid access, satp with tvm=1, stimecmp with stce=0 */
   /*     id     read mask   write mask  phys reg         csr name */
   RV_CSR(0x100, 0x800DE762, 0x800DE762, mstatus);    /*C sstatus */
   RV_CSR(0x104, 0x00000222, 0x00000222, mie);        /*C sie */
@@ -83,7 +182,9 @@ static rv_res rv_csr_bus(rv *cpu, rv_u32 csr, rv_u32 w, rv_u32 *io) {
   RV_CSR(0x141, 0xFFFFFFFF, 0xFFFFFFFF, sepc);       /*C sepc */
   RV_CSR(0x142, 0xFFFFFFFF, 0xFFFFFFFF, scause);     /*C scause */
   RV_CSR(0x143, 0xFFFFFFFF, 0xFFFFFFFF, stval);      /*C stval */
-  RV_CSR(0x144, 0x00000222, 0x00000222, sip);        /*C sip */
+  RV_CSR(0x144, 0x00000222, 0x00000002, mip);        /*C sip */
+  RV_CSR(0x14D, 0xFFFFFFFF, 0xFFFFFFFF, stimecmp);   /*C stimecmp */
+  RV_CSR(0x15D, 0xFFFFFFFF, 0xFFFFFFFF, stimecmph);  /*C stimecmph */
   RV_CSR(0x180, 0xFFFFFFFF, 0xFFFFFFFF, satp);       /*C satp */
   RV_CSR(0x300, 0x807FFFEC, 0x807FFFEC, mstatus);    /*C mstatus */
   RV_CSR(0x301, 0xFFFFFFFF, 0x00000000, misa);       /*C misa */
@@ -92,6 +193,8 @@ static rv_res rv_csr_bus(rv *cpu, rv_u32 csr, rv_u32 w, rv_u32 *io) {
   RV_CSR(0x304, 0xFFFFFFFF, 0x00000AAA, mie);        /*C mie */
   RV_CSR(0x305, 0xFFFFFFFF, 0xFFFFFFFF, mtvec);      /*C mtvec */
   RV_CSR(0x306, 0xFFFFFFFF, 0x00000000, mcounteren); /*C mcounteren */
+  RV_CSR(0x30A, 0xFFFFFFFF, 0x00000000, menvcfg);    /*C menvcfg */
+  RV_CSR(0x31A, 0xFFFFFFFF, 0x80000000, menvcfgh);   /*C menvcfgh */
   RV_CSR(0x310, 0x00000030, 0x00000030, mstatush);   /*C mstatush */
   RV_CSR(0x340, 0xFFFFFFFF, 0xFFFFFFFF, mscratch);   /*C mscratch */
   RV_CSR(0x341, 0xFFFFFFFF, 0xFFFFFFFF, mepc);       /*C mepc */
@@ -112,6 +215,10 @@ static rv_res rv_csr_bus(rv *cpu, rv_u32 csr, rv_u32 w, rv_u32 *io) {
     return RV_BAD;                       /* invalid csr */
   *io = w ? *io : (*y & rm);             /* only read allowed bits */
   *y = w ? (*y & ~wm) | (*io & wm) : *y; /* only write allowed bits  */
+  if (w && csr == 0x180) /* satp changed, the tlb is tagged by asid */
+    cpu->if_va = 0, rv_blkgen(cpu); /* drop fetch translations */
+  if (w && ((csr & ~0x10U) == 0x14D || csr == 0x31A)) /* timer changed */
+    rv_sstc(cpu);
   return RV_OK;
 }
 
@@ -127,6 +234,7 @@ static rv_u32 rv_trap(rv *cpu, rv_u32 cause, rv_u32 tval) {
   rv_u32 *xtvec = &cpu->csr.mtvec, *xepc = &cpu->csr.mepc,
          *xcause = &cpu->csr.mcause, *xtval = &cpu->csr.mtval;
   rv_u32 xie = rv_b(cpu->csr.mstatus, xp);
+  rv_rec(cpu, cpu->pc, 0, cause, tval);
   if (xp == RV_PSUPER) /* select s-mode regs */
     xtvec = &cpu->csr.stvec, xepc = &cpu->csr.sepc, xcause = &cpu->csr.scause,
     xtval = &cpu->csr.stval;
@@ -137,6 +245,8 @@ static rv_u32 rv_trap(rv *cpu, rv_u32 cause, rv_u32 tval) {
   *xepc = cpu->pc;                                             /* xepc <- pc */
   *xcause = rcause | (is_interrupt << 31); /* xcause <- cause */
   *xtval = tval;                           /* xtval <- tval */
+  rv_stat(exc[rcause & 15], !is_interrupt);
+  rv_stat(irq[rcause & 15], is_interrupt);
   cpu->priv = xp;                          /* priv <- x */
   /* if tvec[0], return 4 * cause + vec, otherwise just return vec */
   cpu->pc = (*xtvec & ~3U) + 4 * rcause * ((*xtvec & 1) && is_interrupt);
@@ -151,22 +261,31 @@ static rv_u32 rv_trap_bus(rv *cpu, rv_u32 err, rv_u32 tval, rv_access a) {
   return rv_trap(cpu, ex[(a == RV_AW ? 2 : a == RV_AR) * 3 + err - 1], tval);
 }
 
-/* sv32 virtual address -> physical address */
-static rv_u32 rv_vmm(rv *cpu, rv_u32 va, rv_u32 *pa, rv_access access) {
+/* sv32 virtual address -> physical address, and host pointer if ram != NULL */
+static rv_u32 rv_vmm(rv *cpu, rv_u32 va, rv_u32 *pa, rv_access access,
+                     rv_u8 **ram) {
   rv_u32 epriv = rv_b(cpu->csr.mstatus, 17) && access != RV_AX
                      ? rv_bf(cpu->csr.mstatus, 12, 11)
                      : cpu->priv; /* effective privilege mode */
   if (!rv_b(cpu->csr.satp, 31) || epriv > RV_PSUPER) {
     *pa = va; /* if !satp.mode, no translation */
+    if (ram)
+      *ram = rv_ram(cpu, va);
   } else {
     rv_u32 ppn /* satp.ppn */ = rv_bf(cpu->csr.satp, 21, 0),
                a /* satp.ppn * PAGESIZE */ = ppn << 12, i /* LEVELS - 1 */ = 1,
-               pte, pte_address, tlb_hit = 0;
-    if (cpu->tlb_valid && cpu->tlb_va == (va & ~0xFFFU))
-      pte = cpu->tlb_pte, tlb_hit = 1, i = cpu->tlb_i;
+               pte, pte_address, tlb_hit = 0, x = access == RV_AX,
+               asid /* satp.asid */ = rv_bf(cpu->csr.satp, 30, 22);
+    rv_tlb *t /* tlb entry */ =
+        (x ? cpu->itlb : cpu->dtlb) + (va >> 12 & (RV_TLB_SIZE - 1));
+    if (t->va == ((va & ~0xFFFU) | 1) && (t->asid == asid || rv_b(t->pte, 5)))
+      pte = t->pte, tlb_hit = 1, i = t->i, rv_stat(tlb_hits[x], 1);
+    else
+      rv_stat(tlb_misses[x], 1);
     while (!tlb_hit) {
       /* pte_address = a + va.vpn[i] * PTESIZE */
       pte_address = a + (rv_bf(va, 21 + 10 * i, 12 + 10 * i) << 2);
+      rv_stat(ptes, 1), rv_stat(bus, 1);
       if (cpu->bus_cb(cpu->user, pte_address, (rv_u8 *)&pte, 0, 4))
         return RV_BAD;
       rv_endcvt((rv_u8 *)&pte, (rv_u8 *)&pte, 4, 0);
@@ -179,9 +298,11 @@ static rv_u32 rv_vmm(rv *cpu, rv_u32 va, rv_u32 *pa, rv_access access) {
       i = i - 1;
       a = rv_tbf(pte, 31, 10, 12); /* a = pte.ppn[*] * PAGESIZE */
     }
-    if (!tlb_hit)
-      cpu->tlb_va = va & ~0xFFFU, cpu->tlb_pte = pte, cpu->tlb_i = i,
-      cpu->tlb_valid = 1; /* avoid another pte walk on the next access */
+    if (!tlb_hit) /* avoid another pte walk on the next access */
+      t->va = (va & ~0xFFFU) | 1, t->pte = pte, t->i = i, t->asid = asid,
+      t->pa = rv_tbf(pte, 31, 10 + 10 * i, 12 + 10 * i) |
+              (rv_bf(va, 11 + 10 * i, 12) << 12),
+      t->ram = rv_ram(cpu, t->pa);
     if (rv_b(cpu->csr.mstatus, 19))
       pte |= rv_b(pte, 3) << 2;              /* pte.r = pte.x if mxr bit set */
     if ((!rv_b(pte, 4) && epriv == RV_PUSER) /* u-bit not set */
@@ -192,8 +313,9 @@ static rv_u32 rv_vmm(rv *cpu, rv_u32 va, rv_u32 *pa, rv_access access) {
         || !rv_b(pte, 6)                        /* pte.a == 0 */
         || ((access & RV_AW) && !rv_b(pte, 7))) /* writing and pte.d == 0 */
       return RV_PAGEFAULT;
-    /* pa.ppn[1:i] = pte.ppn[1:i] */
-    *pa = rv_tbf(pte, 31, 10 + 10 * i, 12 + 10 * i) | rv_bf(va, 11 + 10 * i, 0);
+    *pa = t->pa | (va & 0xFFF); /* pa.ppn[1:i] = pte.ppn[1:i] */
+    if (ram)
+      *ram = t->ram ? t->ram + (va & 0xFFF) : NULL;
   }
   return RV_OK;
 }
@@ -366,6 +488,8 @@ static rv_u32 rvc(rv_u32 c) {
   }
 }
 
+rv_u32 rv_decompress(rv_u32 c) { return rvc(c & 0xFFFF); }
+
 void rv_endcvt(rv_u8 *in, rv_u8 *out, rv_u32 width, rv_u32 is_store) {
   if (!is_store && width == 1)
     *out = in[0];
@@ -383,32 +507,160 @@ void rv_endcvt(rv_u8 *in, rv_u8 *out, rv_u32 width, rv_u32 is_store) {
     out[2] = *(rv_u32 *)in >> 16 & 0xFF, out[3] = *(rv_u32 *)in >> 24 & 0xFF;
 }
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* copy between host ram and data; ram is already in host byte order */
+static void rv_ramcpy(rv_u8 *out, rv_u8 *in, rv_u32 width) {
+  if (width == 4)
+    memcpy(out, in, 4); /* fixed sizes compile to a single load and store */
+  else if (width == 2)
+    memcpy(out, in, 2);
+  else
+    *out = *in;
+}
+#define rv_ramld(ram, data, w) rv_ramcpy(data, ram, w)
+#define rv_ramst(ram, data, w) rv_ramcpy(ram, data, w)
+#else
+#define rv_ramld(ram, data, w) rv_endcvt(ram, data, w, 0)
+#define rv_ramst(ram, data, w) rv_endcvt(data, ram, w, 1)
+#endif
+
+/* flush the instruction cache */
+static void rv_icflush(rv *cpu) {
+  rv_u32 x;
+  for (x = 0; x < RV_BLOCKS; x++)
+    cpu->blk[x].pa = 0;
+  memset(cpu->ic_code, 0, sizeof(cpu->ic_code));
+  rv_blkgen(cpu);
+}
+
+void rv_flush(rv *cpu) {
+  rv_tlbflush(cpu, 0, 0, 0);
+  cpu->if_va = 0;
+  rv_icflush(cpu);
+}
+
+void rv_reattach(rv *cpu, void *user, rv_bus_cb bus_cb) {
+  cpu->user = user;
+  cpu->bus_cb = bus_cb;
+  memset(cpu->ram, 0, sizeof(cpu->ram));
+  memset(cpu->ram_size, 0, sizeof(cpu->ram_size));
+  rv_flush(cpu);
+}
+
+#define rv_icword(pg) /* word of the code page bitmap for page pg */           \
+  (cpu->ic_code + (((pg) >> 5) & (RV_ICACHE_PAGES / 32 - 1)))
+
+#define rv_dirtyword(pg) /* word of the dirty page bitmap for page pg */       \
+  (cpu->dirty + (((pg) >> 5) & (RV_DIRTY_PAGES / 32 - 1)))
+
+/* mark the page of a stored-to address dirty and invalidate its blocks */
+static void rv_icstore(rv *cpu, rv_u32 pa) {
+  rv_u32 pg = pa >> 12, *w = rv_icword(pg), b = 1U << (pg & 31), x;
+  *rv_dirtyword(pg) |= b;
+  if (!(*w & b))
+    return; /* no blocks on this page, or on any page aliasing it */
+  *w &= ~b;
+  for (x = 0; x < RV_BLOCKS; x++)
+    if (cpu->blk[x].pa && cpu->blk[x].pa >> 12 == pg)
+      cpu->blk[x].pa = 0;
+    else if (cpu->blk[x].pa && !((cpu->blk[x].pa >> 12 ^ pg) % RV_ICACHE_PAGES))
+      *w |= b; /* an aliasing page still holds blocks */
+  rv_blkgen(cpu);
+}
+
+rv_u32 rv_dirty(rv *cpu, rv_u32 pa) {
+  rv_u32 pg = pa >> 12, *w = rv_dirtyword(pg), b = 1U << (pg & 31);
+  if (!(*w & b))
+    return 0;
+  *w &= ~b;
+  return 1;
+}
+
+rv_res rv_peek(rv *cpu, rv_u32 va, rv_u32 *data) {
+  rv_u32 err, pa;
+  rv_u8 *ram;
+  if (va & 3)
+    return RV_BAD_ALIGN;
+  if ((err = rv_vmm(cpu, va, &pa, RV_AR, &ram)))
+    return err;
+  if (!ram)
+    return RV_BAD; /* not ram: don't disturb a device */
+  rv_ramld(ram, (rv_u8 *)data, 4);
+  return RV_OK;
+}
+
+#ifdef RV_MISALIGNED
+/* perform a misaligned access byte by byte. both pages of one that crosses a
+ * page are translated first, so a fault on either leaves memory untouched;
+ * *va is then left at the faulting page for the trap's tval. */
+static rv_u32 rv_busmis(rv *cpu, rv_u32 *va, rv_u8 *data, rv_u32 width,
+                        rv_access access) {
+  rv_u32 err, pa[2] /* physical addresses */, x, p /* page of byte x */, off;
+  rv_u32 vb /* start of the 2nd page */ = (*va | 0xFFF) + 1, n = vb - *va;
+  rv_u8 ledata[4], *ram[2] /* host pointers if ram */ = {NULL, NULL};
+  if ((err = rv_vmm(cpu, *va, pa, access, ram)))
+    return err; /* page or access fault */
+  if (n < width && (err = rv_vmm(cpu, vb, pa + 1, access, ram + 1)))
+    return *va = vb, err;
+  rv_stat(misaligned, 1), rv_stat(split, n < width);
+  if (access == RV_AW) {
+    rv_endcvt(data, ledata, width, 1);
+    rv_icstore(cpu, pa[0]); /* keep instruction cache coherent with stores */
+    if (n < width)
+      rv_icstore(cpu, pa[1]);
+  }
+  for (x = 0; x < width && x < 4; x++) { /* width is 2 or 4, as misaligned */
+    p = x >= n, off = p ? x - n : x; /* offset into the part on page p */
+    if (ram[p] && access == RV_AW)
+      ram[p][off] = ledata[x];
+    else if (ram[p])
+      ledata[x] = ram[p][off];
+    else if ((err = cpu->bus_cb(cpu->user, pa[p] + off, ledata + x,
+                                access == RV_AW, 1)))
+      return err;
+    rv_stat(bus, !ram[p]);
+  }
+  if (access != RV_AW)
+    rv_endcvt(ledata, data, width, 0);
+  return RV_OK;
+}
+#endif
+
 /* perform a bus access. access == RV_AW stores data. */
 static rv_u32 rv_bus(rv *cpu, rv_u32 *va, rv_u8 *data, rv_u32 width,
                      rv_access access) {
   rv_u32 err, pa /* physical address */;
-  rv_u8 ledata[4];
-  rv_endcvt(data, ledata, width, 1);
+  rv_u8 ledata[4], *ram /* host pointer if pa is ram */;
+  if (access != RV_AX)
+    rv_traceva(*va);
   if (*va & (width - 1))
+#ifdef RV_MISALIGNED
+    return rv_busmis(cpu, va, data, width, access);
+#else
     return RV_BAD_ALIGN;
-  if ((err = rv_vmm(cpu, *va, &pa, access)))
+#endif
+  if ((err = rv_vmm(cpu, *va, &pa, access, &ram)))
     return err; /* page or access fault */
-  if (((pa + width - 1) ^ pa) & ~0xFFFU) /* page bound overrun */ {
-    rv_u32 w0 /* load this many bytes from 1st page */ = 0x1000 - (*va & 0xFFF);
-    if ((err = cpu->bus_cb(cpu->user, pa, ledata, access == RV_AW, w0)))
-      return err;
-    width -= w0, *va += w0, data += w0;
-    if ((err = rv_vmm(cpu, *va, &pa, RV_AW)))
-      return err;
+  if (access == RV_AW)
+    rv_icstore(cpu, pa); /* keep instruction cache coherent with stores */
+  if (ram) { /* aligned, so the access can't cross into another region */
+    if (access == RV_AW)
+      rv_ramst(ram, data, width);
+    else
+      rv_ramld(ram, data, width);
+    return RV_OK;
   }
+  if (access == RV_AW)
+    rv_endcvt(data, ledata, width, 1);
+  rv_stat(bus, 1);
   if ((err = cpu->bus_cb(cpu->user, pa, ledata, access == RV_AW, width)))
     return err;
   rv_endcvt(ledata, data, width, 0);
   return 0;
 }
 
-/* instruction fetch */
-static rv_u32 rv_if(rv *cpu, rv_u32 *i, rv_u32 *tval) {
+/* raw instruction fetch */
+static rv_u32 rv_ifetch(rv *cpu, rv_u32 *i, rv_u32 *tval) {
   rv_u32 err, page = (cpu->pc ^ (cpu->pc + 3)) & ~0xFFFU, pc = cpu->pc;
   if (cpu->pc & 2 || page) { /* perform fetch in two 2-byte fetches */
     rv_u32 ia /* first half of instruction */ = 0, ib /* second half */ = 0;
@@ -420,16 +672,282 @@ static rv_u32 rv_if(rv *cpu, rv_u32 *i, rv_u32 *tval) {
     *i = (rv_u32)ia | (rv_u32)ib << 16U;
   } else if ((err = rv_bus(cpu, &pc, (rv_u8 *)i, 4, RV_AX))) /* 4-byte fetch */
     goto error;
-  cpu->next_pc = cpu->pc + rv_isz(*i);
-  *tval = *i; /* tval is original inst for illegal instruction traps */
-  if (rv_isz(*i) < 4)
-    *i = rvc(*i & 0xFFFF);
   return RV_OK;
 error:
   *tval = pc; /* tval is pc for instruction {page}fault traps */
   return err;
 }
 
+/* predecode instruction */
+static void rv_decode(rv_uop *u, rv_u32 raw) {
+  rv_u32 i = rv_isz(raw) < 4 ? rvc(raw & 0xFFFF) : raw, op = rv_bf(i, 6, 2);
+  u->i = i, u->raw = raw, u->op = (rv_u8)op;
+  u->rd = (rv_u8)rv_ird(i), u->rs1 = (rv_u8)rv_irs1(i);
+  u->rs2 = (rv_u8)rv_irs2(i), u->fn = NULL;
+  u->imm = op == 8                ? rv_iimm_s(i)  /* STORE */
+           : op == 24             ? rv_iimm_b(i)  /* BRANCH */
+           : op == 27             ? rv_iimm_j(i)  /* JAL */
+           : op == 5 || op == 13  ? rv_iimm_u(i)  /* AUIPC, LUI */
+                                  : rv_iimm_i(i); /* everything else */
+}
+
+/* raw instruction fetch from physical address pa, within one page */
+static rv_u32 rv_ifetchpa(rv *cpu, rv_u32 pa, rv_u32 *i) {
+  rv_u8 b[4] = {0} /* instruction bytes */, *ram = rv_ram(cpu, pa);
+  if (ram && (pa & 0xFFF) != 0xFFE) { /* all 4 bytes are on this page */
+    rv_ramld(ram, (rv_u8 *)i, 4);
+    if (pa & 2 && (*i & 3) != 3)
+      *i &= 0xFFFF; /* a halfword fetch, as below */
+    return RV_OK;
+  }
+  rv_stat(bus, 1);
+  if (cpu->bus_cb(cpu->user, pa, b, 0, pa & 2 ? 2 : 4))
+    return RV_BAD;
+  rv_stat(bus, pa & 2 && (b[0] & 3) == 3 && (pa & 0xFFF) != 0xFFE);
+  if (pa & 2 && (b[0] & 3) == 3 && /* if instruction is 4 byte wide */
+      ((pa & 0xFFF) == 0xFFE || cpu->bus_cb(cpu->user, pa + 2, b + 2, 0, 2)))
+    return RV_BAD; /* crosses the page or can't fetch 2nd half */
+  rv_endcvt(b, (rv_u8 *)i, 4, 0);
+  return RV_OK;
+}
+
+#define rv_blkidx(pa) (((pa) >> 1 ^ (pa) >> 12) & (RV_BLOCKS - 1))
+#define rv_blkend(op) ((op) == 3 || (op) == 11 || (op) >= 24) /* last op */
+#define rv_blktag(g) ((g) | cpu->priv << 1 | 1) /* link tag for generation */
+
+/* translate the block at physical address pa, starting with raw */
+static void rv_blkfill(rv *cpu, rv_block *b, rv_u32 pa, rv_u32 raw) {
+  rv_u32 op /* opcode class of last instruction */;
+  *rv_icword(pa >> 12) |= 1U << (pa >> 12 & 31); /* page now holds code */
+  b->pa = pa | 1, b->n = 0, b->hits = 0;
+  b->link_tag[0] = b->link_tag[1] = 0;
+  do
+    rv_decode(b->u + b->n, raw), op = b->u[b->n++].op, pa += rv_isz(raw);
+  while (!rv_blkend(op) && b->n < RV_BLOCK_SIZE && (pa & 0xFFF) &&
+         !rv_ifetchpa(cpu, pa, &raw));
+}
+
+/* find the block at pc, chaining it to the previous block *b */
+static rv_u32 rv_blk(rv *cpu, rv_block **b, rv_block *tmp, rv_u32 *tval) {
+  rv_u32 err, raw, pc = cpu->pc, pa = 0, ok /* pa is valid */ = 0, x, l;
+  rv_u32 va /* fetch translation tag */ = (pc & ~0xFFFU) | cpu->priv << 1 | 1;
+  rv_block *p /* previous block */ = *b;
+  for (l = 0; p && l < 2; l++)
+    if (p->link_tag[l] == rv_blktag(cpu->blk_gen) && p->link_pc[l] == pc)
+      return *b = cpu->blk + p->link[l], RV_OK; /* follow link */
+  if (cpu->if_va == va && !(pc & 1))
+    pa = cpu->if_pa | (pc & 0xFFF), ok = 1;
+  else if (!(pc & 1) && !rv_vmm(cpu, pc, &pa, RV_AX, NULL))
+    cpu->if_va = va, cpu->if_pa = pa & ~0xFFFU, ok = 1;
+  x = rv_blkidx(pa);
+  if (!ok || cpu->blk[x].pa != (pa | 1)) { /* cache miss */
+    if ((err = rv_ifetch(cpu, &raw, tval)))
+      return err; /* on failure, rv_ifetch() reports the fault */
+    if (!ok || (pa & 0xFFF) + rv_isz(raw) > 0x1000) { /* uncacheable */
+      tmp->n = 1, tmp->hits = 0, tmp->link_tag[0] = tmp->link_tag[1] = 0;
+      rv_decode(tmp->u, raw);
+      return *b = tmp, RV_OK;
+    }
+    if (cpu->blk[x].pa)
+      rv_blkgen(cpu); /* evicting a block, drop links to it */
+    rv_blkfill(cpu, cpu->blk + x, pa, raw);
+  }
+  if (p) { /* link previous block to this one */
+    l = p->link_tag[0] == rv_blktag(cpu->blk_gen); /* keep a valid link */
+    p->link_pc[l] = pc, p->link_tag[l] = rv_blktag(cpu->blk_gen);
+    p->link[l] = x;
+  }
+  return *b = cpu->blk + x, RV_OK;
+}
+
+/* hot tier: specialized handlers for common instructions */
+typedef rv_res (*rv_xfn)(rv *cpu, const rv_uop *u);
+
+#define rv_xa cpu->r[u->rs1] /* handler operand a */
+#define rv_xb cpu->r[u->rs2] /* handler operand b */
+#define rv_slt(a, b) (rv_ovf(a, b, (a) - (b)) != rv_sgn((a) - (b)))
+#define rv_sra(a, sh) ((a) >> (sh) | (0U - rv_sgn(a)) << (31 - (sh)))
+
+#define RV_XOP(name, y) /* handler setting rd (nonzero) to y */                \
+  static rv_res rv_x_##name(rv *cpu, const rv_uop *u) {                        \
+    cpu->r[u->rd] = (y);                                                       \
+    return RV_OK;                                                              \
+  }
+
+#define RV_XBR(name, c) /* handler for branch taken if c */                    \
+  static rv_res rv_x_##name(rv *cpu, const rv_uop *u) {                        \
+    if (c)                                                                     \
+      cpu->next_pc = cpu->pc + u->imm;                                         \
+    return RV_OK;                                                              \
+  }
+
+#define RV_XLD(name, w, sx) /* handler for load of width w into rd */          \
+  static rv_res rv_x_##name(rv *cpu, const rv_uop *u) {                        \
+    rv_u32 va = rv_xa + u->imm, v = 0;                                         \
+    if (rv_bus(cpu, &va, (rv_u8 *)&v, w, RV_AR))                               \
+      return RV_BAD;                                                           \
+    cpu->r[u->rd] = sx ? rv_signext(v, w * 8 - 1) : v;                         \
+    return RV_OK;                                                              \
+  }
+
+#define RV_XST(name, w) /* handler for store of width w */                     \
+  static rv_res rv_x_##name(rv *cpu, const rv_uop *u) {                        \
+    rv_u32 va = rv_xa + u->imm, y = rv_xb;                                     \
+    return rv_bus(cpu, &va, (rv_u8 *)&y, w, RV_AW) ? RV_BAD : RV_OK;           \
+  }
+
+RV_XOP(lui, u->imm)                      /*I lui */
+RV_XOP(auipc, cpu->pc + u->imm)          /*I auipc */
+RV_XOP(addi, rv_xa + u->imm)             /*I addi */
+RV_XOP(slti, rv_slt(rv_xa, u->imm))      /*I slti */
+RV_XOP(sltiu, rv_xa < u->imm)            /*I sltiu */
+RV_XOP(xori, rv_xa ^ u->imm)             /*I xori */
+RV_XOP(ori, rv_xa | u->imm)              /*I ori */
+RV_XOP(andi, rv_xa & u->imm)             /*I andi */
+RV_XOP(slli, rv_xa << (u->imm & 31))     /*I slli */
+RV_XOP(srli, rv_xa >> (u->imm & 31))     /*I srli */
+RV_XOP(srai, rv_sra(rv_xa, u->imm & 31)) /*I srai */
+RV_XOP(add, rv_xa + rv_xb)               /*I add */
+RV_XOP(sub, rv_xa - rv_xb)               /*I sub */
+RV_XOP(sll, rv_xa << (rv_xb & 31))       /*I sll */
+RV_XOP(slt, rv_slt(rv_xa, rv_xb))        /*I slt */
+RV_XOP(sltu, rv_xa < rv_xb)              /*I sltu */
+RV_XOP(xor, rv_xa ^ rv_xb)               /*I xor */
+RV_XOP(srl, rv_xa >> (rv_xb & 31))       /*I srl */
+RV_XOP(sra, rv_sra(rv_xa, rv_xb & 31))   /*I sra */
+RV_XOP(or, rv_xa | rv_xb)                /*I or */
+RV_XOP(and, rv_xa & rv_xb)               /*I and */
+RV_XBR(beq, rv_xa == rv_xb)              /*I beq */
+RV_XBR(bne, rv_xa != rv_xb)              /*I bne */
+RV_XBR(blt, rv_slt(rv_xa, rv_xb))        /*I blt */
+RV_XBR(bge, !rv_slt(rv_xa, rv_xb))       /*I bge */
+RV_XBR(bltu, rv_xa < rv_xb)              /*I bltu */
+RV_XBR(bgeu, rv_xa >= rv_xb)             /*I bgeu */
+RV_XLD(lb, 1, 1)                         /*I lb */
+RV_XLD(lh, 2, 1)                         /*I lh */
+RV_XLD(lw, 4, 0)                         /*I lw */
+RV_XLD(lbu, 1, 0)                        /*I lbu */
+RV_XLD(lhu, 2, 0)                        /*I lhu */
+RV_XST(sb, 1)                            /*I sb */
+RV_XST(sh, 2)                            /*I sh */
+RV_XST(sw, 4)                            /*I sw */
+
+/*I mul */
+static rv_res rv_x_mul(rv *cpu, const rv_uop *u) {
+  rv_u32 hi;
+  cpu->r[u->rd] = rvm(rv_xa, rv_xb, &hi);
+  return RV_OK;
+}
+
+/*I jal */
+static rv_res rv_x_jal(rv *cpu, const rv_uop *u) {
+  rv_sr(cpu, u->rd, cpu->next_pc);
+  cpu->next_pc = cpu->pc + u->imm;
+  return RV_OK;
+}
+
+/*I jalr */
+static rv_res rv_x_jalr(rv *cpu, const rv_uop *u) {
+  rv_u32 target = (rv_xa + u->imm) & ~1U;
+  rv_sr(cpu, u->rd, cpu->next_pc);
+  cpu->next_pc = target;
+  return RV_OK;
+}
+
+/* handlers by funct3 */
+static const rv_xfn rv_xopi[8] = {rv_x_addi, rv_x_slli, rv_x_slti, rv_x_sltiu,
+                                  rv_x_xori, rv_x_srli, rv_x_ori,  rv_x_andi};
+static const rv_xfn rv_xop[8] = {rv_x_add, rv_x_sll, rv_x_slt, rv_x_sltu,
+                                 rv_x_xor, rv_x_srl, rv_x_or,  rv_x_and};
+static const rv_xfn rv_xld[8] = {rv_x_lb, rv_x_lh, rv_x_lw, NULL,
+                                 rv_x_lbu, rv_x_lhu, NULL, NULL};
+static const rv_xfn rv_xst[8] = {rv_x_sb, rv_x_sh, rv_x_sw, NULL,
+                                 NULL,    NULL,    NULL,    NULL};
+static const rv_xfn rv_xbr[8] = {rv_x_beq, rv_x_bne,  NULL,     NULL,
+                                 rv_x_blt, rv_x_bge, rv_x_bltu, rv_x_bgeu};
+
+/* specialized handler for u, or NULL to leave it to the interpreter */
+static rv_xfn rv_xsel(const rv_uop *u) {
+  rv_u32 f3 = rv_if3(u->i), f7 = rv_if7(u->i);
+  if (u->op == 4 && u->rd) /* OP-IMM */
+    return (f3 == 1 || f3 == 5) && f7 & 0x5F ? NULL /* shift too big */
+           : f3 == 5 && f7                   ? rv_x_srai
+                                             : rv_xopi[f3];
+  else if (u->op == 12 && u->rd) /* OP */
+    return !f7                 ? rv_xop[f3]
+           : f7 == 32 && !f3   ? rv_x_sub
+           : f7 == 32 && f3 == 5 ? rv_x_sra
+           : f7 == 1 && !f3    ? rv_x_mul
+                               : NULL;
+  else if (u->op == 0 && u->rd) /* LOAD */
+    return rv_xld[f3];
+  else if (u->op == 8) /* STORE */
+    return rv_xst[f3];
+  else if (u->op == 24) /* BRANCH */
+    return rv_xbr[f3];
+  else if (u->op == 25 && !f3) /* JALR */
+    return rv_x_jalr;
+  else if (u->op == 27) /* JAL */
+    return rv_x_jal;
+  else if ((u->op == 5 || u->op == 13) && u->rd) /* AUIPC, LUI */
+    return u->op == 5 ? rv_x_auipc : rv_x_lui;
+  return NULL;
+}
+
+/* value stored by amo funct5 f5 given loaded x and argument b in *y,
+ * returns 0 if f5 is not an amo */
+static rv_u32 rv_amo(rv_u32 f5, rv_u32 x, rv_u32 b, rv_u32 *y) {
+  if (f5 == 0) /*I amoadd.w */
+    *y = x + b;
+  else if (f5 == 1) /*I amoswap.w */
+    *y = b;
+  else if (f5 == 4) /*I amoxor.w */
+    *y = x ^ b;
+  else if (f5 == 8) /*I amoor.w */
+    *y = x | b;
+  else if (f5 == 12) /*I amoand.w */
+    *y = x & b;
+  else if (f5 == 16) /*I amomin.w */
+    *y = rv_sgn(x - b) != rv_ovf(x, b, x - b) ? x : b;
+  else if (f5 == 20) /*I amomax.w */
+    *y = rv_sgn(x - b) == rv_ovf(x, b, x - b) ? x : b;
+  else if (f5 == 24) /*I amominu.w */
+    *y = (x - b) > x ? x : b;
+  else if (f5 == 28) /*I amomaxu.w */
+    *y = (x - b) <= x ? x : b;
+  else
+    return 0;
+  return 1;
+}
+
+#ifdef RV_SMP
+#if !defined(__GNUC__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "RV_SMP requires GNU C atomics on a little-endian host"
+#endif
+/* perform the amo (or lr/sc) in u on the ram word at w with host atomics,
+ * returns RV_BAD if the instruction is illegal */
+static rv_u32 rv_amoram(rv *cpu, const rv_uop *u, rv_u32 va, rv_u32 *w,
+                        rv_u32 *x) {
+  rv_u32 b = rv_lr(cpu, u->rs2), y, f5 = rv_if5(u->i), res = cpu->res_val;
+  if (f5 == 2 && !b) { /* lr.w */
+    *x = cpu->res_val = __atomic_load_n(w, __ATOMIC_SEQ_CST);
+    cpu->res = va, cpu->res_valid = 1;
+  } else if (f5 == 3) { /* sc.w: fail if the word changed since lr.w */
+    *x = !(cpu->res_valid && cpu->res == va) ||
+         !__atomic_compare_exchange_n(w, &res, b, 0, __ATOMIC_SEQ_CST,
+                                      __ATOMIC_SEQ_CST);
+    cpu->res_valid = 0;
+  } else if (!rv_amo(f5, *x = __atomic_load_n(w, __ATOMIC_RELAXED), b, &y)) {
+    return RV_BAD;
+  } else {
+    while (!__atomic_compare_exchange_n(w, x, y, 1, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED))
+      rv_amo(f5, *x, b, &y); /* another hart changed the word, retry */
+  }
+  return RV_OK;
+}
+#endif
+
 /* service interrupts */
 static rv_u32 rv_service(rv *cpu) {
   rv_u32 iidx /* interrupt number */, d /* delegated privilege */;
@@ -443,18 +961,72 @@ static rv_u32 rv_service(rv *cpu) {
   return RV_TRAP_NONE;
 }
 
-/* single step */
-rv_u32 rv_step(rv *cpu) {
-  rv_u32 i, tval, err = rv_if(cpu, &i, &tval); /* fetch instruction into i */
-  if (!++cpu->csr.cycle)
-    cpu->csr.cycleh++; /* add to cycle,cycleh with carry */
-  if (err)
-    return rv_trap_bus(cpu, err, tval, RV_AX); /* instruction fetch error */
-  if (rv_isz(i) != 4)
-    return rv_trap(cpu, RV_EILL, tval); /* instruction length invalid */
-  if (rv_iopl(i) == 0) {
-    if (rv_ioph(i) == 0) { /*Q 00/000: LOAD */
-      rv_u32 va /* virtual address */ = rv_lr(cpu, rv_irs1(i)) + rv_iimm_i(i);
+/* instruction dispatch on opcode class: an if-else chain by default; with
+ * RV_DISPATCH_THREADED, computed goto on GNU C compilers, else a switch */
+#if defined(RV_DISPATCH_THREADED) && defined(__GNUC__)
+#define RV_DISPATCH goto *rv_ops[u->op]; {
+#define RV_OP(n) } goto next; rv_op_##n: {
+#define RV_OP2(a, b) } goto next; rv_op_##a: rv_op_##b: {
+#define RV_ILL } goto next; rv_ill: {
+#define RV_END }
+#elif defined(RV_DISPATCH_THREADED)
+#define RV_DISPATCH switch (u->op) { {
+#define RV_OP(n) } break; case n: {
+#define RV_OP2(a, b) } break; case a: case b: {
+#define RV_ILL } break; default: {
+#define RV_END } }
+#else
+#define RV_DISPATCH if (0) {
+#define RV_OP(n) } else if (u->op == n) {
+#define RV_OP2(a, b) } else if (u->op == a || u->op == b) {
+#define RV_ILL } else {
+#define RV_END }
+#endif
+
+/* execute up to budget instructions, counting them in *n */
+static rv_u32 rv_exec(rv *cpu, rv_u32 budget, rv_u32 *n) {
+  rv_block tmp /* storage for an uncacheable instruction */, *blk = NULL;
+  rv_uop *u = NULL, *end = NULL; /* next instruction, end of block */
+  rv_u32 i, tval, err, chk /* check for interrupts */ = 1, gen = cpu->blk_gen;
+#if defined(RV_DISPATCH_THREADED) && defined(__GNUC__)
+  static void *const rv_ops[32] = {
+      &&rv_op_0,  &&rv_ill,   &&rv_ill,  &&rv_op_3,  &&rv_op_4,  &&rv_op_5,
+      &&rv_ill,   &&rv_ill,   &&rv_op_8, &&rv_ill,   &&rv_ill,   &&rv_op_11,
+      &&rv_op_12, &&rv_op_13, &&rv_ill,  &&rv_ill,   &&rv_ill,   &&rv_ill,
+      &&rv_ill,   &&rv_ill,   &&rv_ill,  &&rv_ill,   &&rv_ill,   &&rv_ill,
+      &&rv_op_24, &&rv_op_25, &&rv_ill,  &&rv_op_27, &&rv_op_28, &&rv_ill,
+      &&rv_ill,   &&rv_ill};
+#endif
+  if (cpu->blk_rpc == cpu->pc && cpu->blk_rtag == rv_blktag(gen))
+    blk = cpu->blk + cpu->blk_cur, u = blk->u + cpu->blk_pos,
+    end = blk->u + blk->n; /* resume where the last call left off */
+  while (*n < budget && !rv_tracefull(cpu)) {
+    if (u != end)
+      err = RV_OK;
+    else if (!(err = rv_blk(cpu, &blk, &tmp, &tval))) { /* enter next block */
+      u = blk->u, end = u + blk->n, gen = cpu->blk_gen;
+      if (cpu->hot && ++blk->hits == cpu->hot) /* block became hot */
+        for (; u != end; u++)
+          u->fn = rv_xsel(u);
+      u = blk->u;
+    }
+    ++*n;
+    if (!++cpu->csr.cycle)
+      cpu->csr.cycleh++; /* add to cycle,cycleh with carry */
+    if (err)
+      return rv_trap_bus(cpu, err, tval, RV_AX); /* instruction fetch error */
+    i = u->i, tval = u->raw; /* tval is original inst for illegal inst. traps */
+    cpu->next_pc = cpu->pc + rv_isz(u->raw);
+    if (rv_isz(i) != 4)
+      return rv_trap(cpu, RV_EILL, tval); /* instruction length invalid */
+    if (u->fn && !u->fn(cpu, u)) { /* specialized handler ran */
+      if (cpu->blk_gen != gen)
+        end = u + 1; /* blocks were invalidated, leave this one */
+      goto next;
+    }
+    RV_DISPATCH
+    RV_OP(0) /*Q 00/000: LOAD */
+      rv_u32 va /* virtual address */ = rv_lr(cpu, u->rs1) + u->imm;
       rv_u32 v /* loaded value */ = 0, w /* value width */, sx /* sign ext. */;
       w = 1 << (rv_if3(i) & 3), sx = ~rv_if3(i) & 4; /*I lb, lh, lw, lbu, lhu */
       if ((err = rv_bus(cpu, &va, (rv_u8 *)&v, w, RV_AR)))
@@ -463,20 +1035,22 @@ rv_u32 rv_step(rv *cpu) {
         return rv_trap(cpu, RV_EILL, tval); /* ld instruction not supported */
       if (sx)
         v = rv_signext(v, (w * 8 - 1));
-      rv_sr(cpu, rv_ird(i), v);
-    } else if (rv_ioph(i) == 1) { /*Q 01/000: STORE */
-      rv_u32 va /* virtual address */ = rv_lr(cpu, rv_irs1(i)) + rv_iimm_s(i);
+      rv_sr(cpu, u->rd, v);
+    RV_OP(8) /*Q 01/000: STORE */
+      rv_u32 va /* virtual address */ = rv_lr(cpu, u->rs1) + u->imm;
       rv_u32 w /* value width */ = 1 << (rv_if3(i) & 3);
-      rv_u32 y /* stored value */ = rv_lr(cpu, rv_irs2(i));
+      rv_u32 y /* stored value */ = rv_lr(cpu, u->rs2);
       if (rv_if3(i) > 2)                    /*I sb, sh, sw */
         return rv_trap(cpu, RV_EILL, tval); /* sd instruction not supported */
       if ((err = rv_bus(cpu, &va, (rv_u8 *)&y, w, RV_AW)))
         return rv_trap_bus(cpu, err, va, RV_AW);
-    } else if (rv_ioph(i) == 3) { /*Q 11/000: BRANCH */
-      rv_u32 a = rv_lr(cpu, rv_irs1(i)), b = rv_lr(cpu, rv_irs2(i));
+      if (cpu->blk_gen != gen)
+        end = u + 1; /* blocks were invalidated, leave this one */
+    RV_OP(24) /*Q 11/000: BRANCH */
+      rv_u32 a = rv_lr(cpu, u->rs1), b = rv_lr(cpu, u->rs2);
       rv_u32 y /* comparison value */ = a - b;
       rv_u32 zero = !y, sgn = rv_sgn(y), ovf = rv_ovf(a, b, y), carry = y > a;
-      rv_u32 targ = cpu->pc + rv_iimm_b(i);   /* computed branch target */
+      rv_u32 targ = cpu->pc + u->imm;         /* computed branch target */
       if ((rv_if3(i) == 0 && zero) ||         /*I beq */
           (rv_if3(i) == 1 && !zero) ||        /*I bne */
           (rv_if3(i) == 4 && (sgn != ovf)) || /*I blt */
@@ -488,72 +1062,64 @@ rv_u32 rv_step(rv *cpu) {
       } else if (rv_if3(i) == 2 || rv_if3(i) == 3)
         return rv_trap(cpu, RV_EILL, tval);
       /* default: don't take branch [fall through here] */
-    } else
-      return rv_trap(cpu, RV_EILL, tval);
-  } else if (rv_iopl(i) == 1) {
-    if (rv_ioph(i) == 3 && rv_if3(i) == 0) { /*Q 11/001: JALR */
-      rv_u32 target = (rv_lr(cpu, rv_irs1(i)) + rv_iimm_i(i)); /*I jalr */
-      rv_sr(cpu, rv_ird(i), cpu->next_pc);
+    RV_OP(25) /*Q 11/001: JALR */
+      rv_u32 target = (rv_lr(cpu, u->rs1) + u->imm); /*I jalr */
+      if (rv_if3(i))
+        return rv_trap(cpu, RV_EILL, tval);
+      rv_sr(cpu, u->rd, cpu->next_pc);
       cpu->next_pc = target & ~1U; /* target is two-byte aligned */
-    } else
-      return rv_trap(cpu, RV_EILL, tval);
-  } else if (rv_iopl(i) == 3) {
-    if (rv_ioph(i) == 0) {            /*Q 00/011: MISC-MEM */
+    RV_OP(3) /*Q 00/011: MISC-MEM */
       if (rv_if3(i) == 0) {           /*I fence */
         rv_u32 fm = rv_bf(i, 31, 28); /* extract fm field */
         if (fm && fm != 8)
           return rv_trap(cpu, RV_EILL, tval);
+#ifdef RV_SMP
+        __atomic_thread_fence(__ATOMIC_SEQ_CST); /* order ram between harts */
+#endif
       } else if (rv_if3(i) == 1) { /*I fence.i */
+        rv_icflush(cpu);
       } else
         return rv_trap(cpu, RV_EILL, tval);
-    } else if (rv_ioph(i) == 1) { /*Q 01/011: AMO */
-      rv_u32 va /* address */ = rv_lr(cpu, rv_irs1(i));
-      rv_u32 b /* argument */ = rv_lr(cpu, rv_irs2(i));
+    RV_OP(11) /*Q 01/011: AMO */
+      rv_u32 va /* address */ = rv_lr(cpu, u->rs1);
+      rv_u32 b /* argument */ = rv_lr(cpu, u->rs2);
       rv_u32 x /* loaded value */ = 0, y /* stored value */ = b;
       rv_u32 l /* should load? */ = rv_if5(i) != 3, s /* should store? */ = 1;
+#ifdef RV_SMP
+      rv_u32 pa;
+      rv_u8 *ram /* host pointer if va is writable ram */ = NULL;
+      if (rv_bf(i, 14, 12) == 2 && !(va & 3) &&
+          !rv_vmm(cpu, va, &pa, RV_AW, &ram) && ram) {
+        rv_traceva(va);
+        if (rv_amoram(cpu, u, va, (rv_u32 *)ram, &x))
+          return rv_trap(cpu, RV_EILL, tval);
+        if (rv_if5(i) != 2 && (rv_if5(i) != 3 || !x))
+          rv_icstore(cpu, pa); /* the word was stored */
+      } else
+#endif
       if (rv_bf(i, 14, 12) != 2) { /* width must be 2 */
         return rv_trap(cpu, RV_EILL, tval);
+      } else if (va & 3) { /* even with RV_MISALIGNED */
+        return rv_trap_bus(cpu, RV_BAD_ALIGN, va, l ? RV_AR : RV_AW);
       } else {
         if (l && (err = rv_bus(cpu, &va, (rv_u8 *)&x, 4, RV_AR)))
           return rv_trap_bus(cpu, err, va, RV_AR);
-        if (rv_if5(i) == 0) /*I amoadd.w */
-          y = x + b;
-        else if (rv_if5(i) == 1) /*I amoswap.w */
-          y = b;
-        else if (rv_if5(i) == 2 && !b) /*I lr.w */
-          cpu->res = va, cpu->res_valid = 1, s = 0;
+        if (rv_if5(i) == 2 && !b) /*I lr.w */
+          cpu->res = va, cpu->res_valid = 1, cpu->res_val = x, s = 0;
         else if (rv_if5(i) == 3) /*I sc.w */
           x = !(cpu->res_valid && cpu->res_valid-- && cpu->res == va), s = !x;
-        else if (rv_if5(i) == 4) /*I amoxor.w */
-          y = x ^ b;
-        else if (rv_if5(i) == 8) /*I amoor.w */
-          y = x | b;
-        else if (rv_if5(i) == 12) /*I amoand.w */
-          y = x & b;
-        else if (rv_if5(i) == 16) /*I amomin.w */
-          y = rv_sgn(x - b) != rv_ovf(x, b, x - b) ? x : b;
-        else if (rv_if5(i) == 20) /*I amomax.w */
-          y = rv_sgn(x - b) == rv_ovf(x, b, x - b) ? x : b;
-        else if (rv_if5(i) == 24) /*I amominu.w */
-          y = (x - b) > x ? x : b;
-        else if (rv_if5(i) == 28) /*I amomaxu.w */
-          y = (x - b) <= x ? x : b;
-        else
+        else if (!rv_amo(rv_if5(i), x, b, &y))
           return rv_trap(cpu, RV_EILL, tval);
         if (s && (err = rv_bus(cpu, &va, (rv_u8 *)&y, 4, RV_AW)))
           return rv_trap_bus(cpu, err, va, RV_AW);
       }
-      rv_sr(cpu, rv_ird(i), x);
-    } else if (rv_ioph(i) == 3) {          /*Q 11/011: JAL */
-      rv_sr(cpu, rv_ird(i), cpu->next_pc); /*I jal */
-      cpu->next_pc = cpu->pc + rv_iimm_j(i);
-    } else
-      return rv_trap(cpu, RV_EILL, tval);
-  } else if (rv_iopl(i) == 4) { /* ALU section */
-    if (rv_ioph(i) == 0 ||      /*Q 00/100: OP-IMM */
-        rv_ioph(i) == 1) {      /*Q 01/100: OP */
-      rv_u32 a = rv_lr(cpu, rv_irs1(i)),
-             b = rv_ioph(i) ? rv_lr(cpu, rv_irs2(i)) : rv_iimm_i(i),
+      rv_sr(cpu, u->rd, x);
+    RV_OP(27) /*Q 11/011: JAL */
+      rv_sr(cpu, u->rd, cpu->next_pc); /*I jal */
+      cpu->next_pc = cpu->pc + u->imm;
+    RV_OP2(4, 12) /*Q 00/100: OP-IMM, 01/100: OP */
+      rv_u32 a = rv_lr(cpu, u->rs1),
+             b = rv_ioph(i) ? rv_lr(cpu, u->rs2) : u->imm,
              s /* alt. ALU op */ = (rv_ioph(i) || rv_if3(i)) ? rv_b(i, 30) : 0,
              y /* result */, sh /* shift amount */ = b & 0x1F;
       if (!rv_ioph(i) || !rv_b(i, 25)) {
@@ -598,34 +1164,35 @@ rv_u32 rv_step(rv *cpu) {
             y = a % b;
         } /* all this because we don't have 64bits. worth it? probably not B) */
       }
-      rv_sr(cpu, rv_ird(i), y);   /* set register to ALU output */
-    } else if (rv_ioph(i) == 3) { /*Q 11/100: SYSTEM */
+      rv_sr(cpu, u->rd, y);       /* set register to ALU output */
+    RV_OP(28) /*Q 11/100: SYSTEM */
       rv_u32 csr /* CSR number */ = rv_iimm_iu(i), y /* result */;
-      rv_u32 s /* uimm */ = rv_if3(i) & 4 ? rv_irs1(i) : rv_lr(cpu, rv_irs1(i));
+      rv_u32 s /* uimm */ = rv_if3(i) & 4 ? u->rs1 : rv_lr(cpu, u->rs1);
+      chk = 1; /* csr writes and xret can unmask interrupts */
       if ((rv_if3(i) & 3) == 1) {          /*I csrrw, csrrwi */
-        if (rv_irs1(i)) {                  /* perform CSR load */
+        if (u->rs1) {                      /* perform CSR load */
           if (rv_csr_bus(cpu, csr, 0, &y)) /* load CSR into y */
             return rv_trap(cpu, RV_EILL, tval);
-          if (rv_ird(i))
-            rv_sr(cpu, rv_ird(i), y); /* store y into rd */
+          if (u->rd)
+            rv_sr(cpu, u->rd, y); /* store y into rd */
         }
         if (rv_csr_bus(cpu, csr, 1, &s)) /* set CSR to s */
           return rv_trap(cpu, RV_EILL, tval);
       } else if ((rv_if3(i) & 3) == 2) { /*I csrrs, csrrsi */
         if (rv_csr_bus(cpu, csr, 0, &y)) /* load CSR into y */
           return rv_trap(cpu, RV_EILL, tval);
-        rv_sr(cpu, rv_ird(i), y), y |= s;              /* store y into rd  */
-        if (rv_irs1(i) && rv_csr_bus(cpu, csr, 1, &y)) /*     s|y into CSR */
+        rv_sr(cpu, u->rd, y), y |= s;              /* store y into rd  */
+        if (u->rs1 && rv_csr_bus(cpu, csr, 1, &y)) /*     s|y into CSR */
           return rv_trap(cpu, RV_EILL, tval);
       } else if ((rv_if3(i) & 3) == 3) { /*I csrrc, csrrci */
         if (rv_csr_bus(cpu, csr, 0, &y)) /* load CSR into y */
           return rv_trap(cpu, RV_EILL, tval);
-        rv_sr(cpu, rv_ird(i), y), y &= ~s;             /* store y into rd  */
-        if (rv_irs1(i) && rv_csr_bus(cpu, csr, 1, &y)) /*    ~s&y into CSR */
+        rv_sr(cpu, u->rd, y), y &= ~s;             /* store y into rd  */
+        if (u->rs1 && rv_csr_bus(cpu, csr, 1, &y)) /*    ~s&y into CSR */
           return rv_trap(cpu, RV_EILL, tval);
       } else if (!rv_if3(i)) {
-        if (!rv_ird(i)) {
-          if (!rv_irs1(i) && rv_irs2(i) == 2 &&
+        if (!u->rd) {
+          if (!u->rs1 && u->rs2 == 2 &&
               (rv_if7(i) == 8 || rv_if7(i) == 24)) { /*I mret, sret */
             rv_u32 xp /* instruction privilege */ = rv_if7(i) >> 3;
             rv_u32 yp /* previous (incoming) privilege [either mpp or spp] */ =
@@ -643,16 +1210,24 @@ rv_u32 rv_step(rv *cpu) {
                                 | mprv << 17;   /* mprv <- mprv' */
             cpu->priv = yp;                     /* priv <- y */
             cpu->next_pc = xp == RV_PMACH ? cpu->csr.mepc : cpu->csr.sepc;
-          } else if (rv_irs2(i) == 5 && rv_if7(i) == 8) { /*I wfi */
+          } else if (u->rs2 == 5 && rv_if7(i) == 8) { /*I wfi */
+            rv_recu(u);
             cpu->pc = cpu->next_pc;
             return (err = rv_service(cpu)) == RV_TRAP_NONE ? RV_TRAP_WFI : err;
           } else if (rv_if7(i) == 9) { /*I sfence.vma */
             if (cpu->priv == RV_PSUPER && (cpu->csr.mstatus & (1 << 20)))
               return rv_trap(cpu, RV_EILL, tval);
-            cpu->tlb_valid = 0;
-          } else if (!rv_irs1(i) && !rv_irs2(i) && !rv_if7(i)) { /*I ecall */
+            rv_tlbflush(cpu, rv_lr(cpu, u->rs1), rv_lr(cpu, u->rs2) & 0x1FF,
+                        (u->rs1 ? RV_TLB_VA : 0) | (u->rs2 ? RV_TLB_ASID : 0));
+            cpu->if_va = 0, rv_blkgen(cpu);
+          } else if (!u->rs1 && !u->rs2 && !rv_if7(i)) { /*I ecall */
+            if (cpu->ecall >> cpu->priv & 1) { /* host services the call */
+              rv_recu(u);
+              cpu->pc = cpu->next_pc;
+              return RV_TRAP_ECALL;
+            }
             return rv_trap(cpu, RV_EUECALL + cpu->priv, cpu->pc);
-          } else if (!rv_irs1(i) && rv_irs2(i) == 1 && !rv_if7(i)) {
+          } else if (!u->rs1 && u->rs2 == 1 && !rv_if7(i)) {
             return rv_trap(cpu, RV_EBP, cpu->pc); /*I ebreak */
           } else
             return rv_trap(cpu, RV_EILL, tval);
@@ -660,24 +1235,44 @@ rv_u32 rv_step(rv *cpu) {
           return rv_trap(cpu, RV_EILL, tval);
       } else
         return rv_trap(cpu, RV_EILL, tval);
-    } else
-      return rv_trap(cpu, RV_EILL, tval);
-  } else if (rv_iopl(i) == 5) {
-    if (rv_ioph(i) == 0) {                           /*Q 00/101: AUIPC */
-      rv_sr(cpu, rv_ird(i), rv_iimm_u(i) + cpu->pc); /*I auipc */
-    } else if (rv_ioph(i) == 1) {                    /*Q 01/101: LUI */
-      rv_sr(cpu, rv_ird(i), rv_iimm_u(i));           /*I lui */
-    } else
+    RV_OP(5) /*Q 00/101: AUIPC */
+      rv_sr(cpu, u->rd, u->imm + cpu->pc); /*I auipc */
+    RV_OP(13) /*Q 01/101: LUI */
+      rv_sr(cpu, u->rd, u->imm);           /*I lui */
+    RV_ILL
       return rv_trap(cpu, RV_EILL, tval);
-  } else
-    return rv_trap(cpu, RV_EILL, tval);
-  cpu->pc = cpu->next_pc;
-  if (cpu->csr.mip && (err = rv_service(cpu)) != RV_TRAP_NONE)
-    return err;
-  return RV_TRAP_NONE; /* reserved code -- no exception */
+    RV_END
+  next:
+    rv_stat(op[u->op], 1), rv_stat(compressed, rv_isz(u->raw) < 4);
+    rv_recu(u);
+    cpu->pc = cpu->next_pc, u++;
+    if (chk && cpu->csr.mip && (err = rv_service(cpu)) != RV_TRAP_NONE)
+      return err; /* mip only changes from outside or via SYSTEM */
+    chk = 0;
+  }
+  cpu->blk_rtag = 0;
+  if (blk && blk != &tmp) /* resume in this block on the next call */
+    cpu->blk_rpc = cpu->pc, cpu->blk_rtag = rv_blktag(gen),
+    cpu->blk_cur = (rv_u32)(blk - cpu->blk),
+    cpu->blk_pos = (rv_u32)(u - blk->u);
+  return RV_TRAP_NONE;
+}
+
+/* single step */
+rv_u32 rv_step(rv *cpu) { return rv_run(cpu, 1, NULL); }
+
+/* run up to budget instructions */
+rv_u32 rv_run(rv *cpu, rv_u32 budget, rv_u32 *ran) {
+  rv_u32 n /* instructions executed */ = 0, err;
+  rv_sstc(cpu); /* the host may have moved time */
+  err = rv_exec(cpu, budget, &n);
+  if (ran)
+    *ran = n;
+  return err;
 }
 
 void rv_irq(rv *cpu, rv_cause cause) {
   cpu->csr.mip &= ~(rv_u32)(RV_CSI | RV_CTI | RV_CEI);
   cpu->csr.mip |= cause;
+  rv_sstc(cpu);
 }
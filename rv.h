@@ -55,16 +55,110 @@ typedef rv_u32 rv_res;
 #define RV_PAGEFAULT 3
 #define RV_TRAP_NONE 0x80000010
 #define RV_TRAP_WFI 0x80000011
+#define RV_TRAP_ECALL 0x80000012
 
 typedef struct rv_csr {
   rv_u32 /* sstatus, */ sie, stvec, scounteren, sscratch, sepc, scause, stval,
-      sip, satp;
-  rv_u32 mstatus, misa, medeleg, mideleg, mie, mtvec, mcounteren, mstatush,
-      mscratch, mepc, mcause, mtval, mip, mtime, mtimeh, mvendorid, marchid,
-      mimpid, mhartid;
+      /* sip, */ satp, stimecmp, stimecmph;
+  rv_u32 mstatus, misa, medeleg, mideleg, mie, mtvec, mcounteren, menvcfg,
+      menvcfgh, mstatush, mscratch, mepc, mcause, mtval, mip, mtime, mtimeh,
+      mvendorid, marchid, mimpid, mhartid;
   rv_u32 cycle, cycleh;
 } rv_csr;
 
+#ifndef RV_BLOCKS
+#define RV_BLOCKS 256 /* translated blocks, must be power of 2 */
+#endif
+
+#ifndef RV_BLOCK_SIZE
+#define RV_BLOCK_SIZE 32 /* maximum instructions per block */
+#endif
+
+#ifndef RV_TLB_SIZE
+#define RV_TLB_SIZE 64 /* entries in each of the I-TLB and D-TLB, power of 2 */
+#endif
+
+#ifndef RV_ICACHE_PAGES
+#define RV_ICACHE_PAGES 32768 /* pages tracked for code invalidation (128MiB) */
+#endif
+
+#ifndef RV_DIRTY_PAGES
+#define RV_DIRTY_PAGES 32768 /* pages tracked for stores (128MiB), power of 2 */
+#endif
+
+#ifndef RV_RAM_REGIONS
+#define RV_RAM_REGIONS 2 /* host memory regions that bypass the bus callback */
+#endif
+
+/* Direct-mapped TLB entry, tagged with the address space id. */
+typedef struct rv_tlb {
+  rv_u32 va;   /* virtual page | 1 if valid */
+  rv_u32 pa;   /* physical page */
+  rv_u32 pte;  /* leaf page table entry */
+  rv_u32 i;    /* level of leaf page table entry */
+  rv_u32 asid; /* address space id, ignored if pte.g is set */
+  rv_u8 *ram;  /* host pointer to the physical page if it is ram, or NULL */
+} rv_tlb;
+
+struct rv;
+
+/* Predecoded instruction. */
+typedef struct rv_uop {
+  rv_u32 i;               /* instruction, decompressed if compressed */
+  rv_u32 raw;             /* instruction as fetched */
+  rv_u32 imm;             /* sign-extended immediate */
+  rv_u8 op, rd, rs1, rs2; /* opcode class (i[6:2]) and register indices */
+  /* specialized handler for hot blocks, returns RV_BAD to defer to the
+   * interpreter (which then raises any trap) */
+  rv_res (*fn)(struct rv *cpu, const struct rv_uop *u);
+} rv_uop;
+
+/* Translated basic block: straight-line code up to a control transfer. */
+typedef struct rv_block {
+  rv_u32 pa;               /* physical address of first instruction | 1 */
+  rv_u32 n;                /* number of instructions */
+  rv_u32 hits;             /* times entered, for the hot tier */
+  rv_u32 link_pc[2];       /* pc of chained successors */
+  rv_u32 link_tag[2];      /* generation | priv << 1 | 1 when chained */
+  rv_u32 link[2];          /* index of chained successors */
+  rv_uop u[RV_BLOCK_SIZE]; /* instructions */
+} rv_block;
+
+#ifdef RV_STATS
+/* Execution statistics, counted when RV_STATS is defined. Counters wrap. */
+typedef struct rv_stats {
+  rv_u32 op[32];        /* instructions retired per opcode class (i[6:2]) */
+  rv_u32 compressed;    /* instructions retired that were compressed */
+  rv_u32 exc[16];       /* exceptions taken, by cause */
+  rv_u32 irq[16];       /* interrupts taken, by cause */
+  rv_u32 tlb_hits[2];   /* tlb hits: [0] data, [1] instruction */
+  rv_u32 tlb_misses[2]; /* tlb misses: [0] data, [1] instruction */
+  rv_u32 ptes;          /* page table entries read by walks on tlb misses */
+  rv_u32 bus;           /* bus callbacks: mmio, walks and ram not mapped */
+  rv_u32 misaligned;    /* misaligned loads and stores, with RV_MISALIGNED */
+  rv_u32 split;         /* misaligned loads and stores that crossed a page */
+} rv_stats;
+#endif
+
+#ifdef RV_TRACE
+/* Execution trace record, written when RV_TRACE is defined. */
+typedef struct rv_trace_rec {
+  rv_u32 pc;   /* address of the instruction, or of where the trap was taken */
+  rv_u32 inst; /* instruction as fetched (16 bits if compressed), 0 if trap */
+  rv_u32 rd;   /* value of rd after the instruction, or the trap's cause */
+  rv_u32 addr; /* address loaded or stored (else 0), or the trap's tval */
+} rv_trace_rec;
+
+/* Lock-free trace ring with one producer, the hart, and one consumer. */
+typedef struct rv_trace {
+  rv_trace_rec *rec; /* ring of `mask` + 1 records (a power of 2), or NULL */
+  rv_u32 mask;
+  rv_u32 head; /* records written, only advanced by the hart (release) */
+  rv_u32 tail; /* records consumed, only advanced by the consumer (release) */
+  rv_u32 va;   /* last data address, for the next record */
+} rv_trace;
+#endif
+
 typedef enum rv_priv { RV_PUSER = 0, RV_PSUPER = 1, RV_PMACH = 3 } rv_priv;
 typedef enum rv_access { RV_AR = 1, RV_AW = 2, RV_AX = 4 } rv_access;
 typedef enum rv_cause { RV_CSI = 8, RV_CTI = 128, RV_CEI = 512 } rv_cause;
@@ -83,18 +177,100 @@ typedef struct rv {
   rv_csr csr;            /* csr state */
   rv_u32 priv;           /* current privilege level*/
   rv_u32 res, res_valid; /* lr/sc reservation set */
-  rv_u32 tlb_va, tlb_pte, tlb_valid, tlb_i;
+  rv_u32 res_val;        /* word loaded by lr, compared by sc with RV_SMP */
+  rv_u32 ram_base[RV_RAM_REGIONS], ram_size[RV_RAM_REGIONS]; /* host ram */
+  rv_u8 *ram[RV_RAM_REGIONS];
+  rv_tlb itlb[RV_TLB_SIZE], dtlb[RV_TLB_SIZE]; /* instruction and data TLB */
+  rv_u32 if_va, if_pa; /* last fetch translation: va | priv << 1 | 1, pa */
+  rv_u32 hot;     /* enter blocks this many times before specializing them */
+  rv_u32 ecall;   /* bit p set: ecall from privilege p returns to the host */
+  rv_u32 blk_gen;                             /* advanced to drop block links */
+  rv_u32 blk_rpc, blk_rtag, blk_cur, blk_pos; /* where to resume execution */
+  rv_block blk[RV_BLOCKS];                    /* block cache */
+  rv_u32 ic_code[RV_ICACHE_PAGES / 32];       /* bitmap: pages with blocks */
+  rv_u32 dirty[RV_DIRTY_PAGES / 32];          /* bitmap: pages stored to */
+#ifdef RV_STATS
+  rv_stats stats; /* cleared by `rv_init`, the host may clear it any time */
+#endif
+#ifdef RV_TRACE
+  rv_trace trace; /* cleared by `rv_init`, the host sets `rec` and `mask` */
+#endif
 } rv;
 
-/* Initialize CPU. You can call this again on `cpu` to reset it. */
+/* Define RV_SMP to run harts sharing ram on separate host threads (requires
+ * GNU C atomics on a little-endian host). AMOs on ram mapped by `rv_map_ram`
+ * then use host atomics, `fence` is a host memory barrier, and sc.w succeeds
+ * only if the reserved word still holds the value lr.w loaded, so a store by
+ * another hart that changes it breaks the reservation. */
+
+/* Define RV_MISALIGNED to perform misaligned loads and stores instead of
+ * raising address-misaligned exceptions. They are split into byte accesses;
+ * one that crosses a page translates both pages first, so a page fault on the
+ * second leaves the first untouched. AMOs and lr/sc must still be aligned. */
+
+/* Define RV_TRACE to record every retired instruction and trap into
+ * `cpu->trace` (requires GNU C atomics). The host drains records from `tail`
+ * on another thread; when the ring is full, `rv_run` returns early, having
+ * run fewer instructions, rather than drop records. */
+
+/* Initialize CPU. You can call this again on `cpu` to reset it.
+ * The hot block tier is off by default: set `cpu->hot` to a nonzero count to
+ * run blocks through specialized handlers once entered that many times.
+ * Instructions are cached after their first fetch: if the host modifies code
+ * in memory behind the CPU's back, it must reinitialize the CPU. */
 void rv_init(rv *cpu, void *user, rv_bus_cb bus_cb);
 
+/* Map `size` bytes of host memory at `host` to physical address `base`.
+ * Loads, stores and fetches within the region then bypass `bus_cb`, which is
+ * only called for MMIO. `base` and `size` must be multiples of 4096, and the
+ * memory is little-endian. Call this after `rv_init`, which clears all regions.
+ * Returns `RV_BAD` if all `RV_RAM_REGIONS` regions are in use. */
+rv_res rv_map_ram(rv *cpu, rv_u32 base, rv_u32 size, rv_u8 *host);
+
+/* Returns 1 if the page holding physical address `pa` may have been stored to
+ * since the last call for it, and clears its mark. Pages are tracked modulo
+ * `RV_DIRTY_PAGES`, so a store also marks the pages aliasing its page. */
+rv_u32 rv_dirty(rv *cpu, rv_u32 pa);
+
+/* Load the word at virtual address `va` as the CPU would, but without taking
+ * a trap, for profilers and debuggers. Only ram mapped with `rv_map_ram` is
+ * read, so devices never see the access; translation may fill the TLB.
+ * Returns `RV_OK`, `RV_BAD_ALIGN`, `RV_PAGEFAULT`, or `RV_BAD`. */
+rv_res rv_peek(rv *cpu, rv_u32 va, rv_u32 *data);
+
+/* Drop all cached address translations and blocks, as if the CPU executed
+ * `sfence.vma` and `fence.i`. Hosts use this to carry out remote fences. */
+void rv_flush(rv *cpu);
+
+/* Reattach a CPU whose state was copied in from elsewhere (e.g. a snapshot
+ * file): set the callback, unmap all ram, and drop the cached translations and
+ * blocks, which hold host pointers. Architectural state is kept. Map ram again
+ * with `rv_map_ram`. */
+void rv_reattach(rv *cpu, void *user, rv_bus_cb bus_cb);
+
 /* Single-step CPU. Returns trap cause if trap occurred, else `RV_TRAP_NONE` */
 rv_u32 rv_step(rv *cpu);
 
-/* Trigger interrupt(s). */
+/* Run CPU for up to `budget` instructions, stopping early on a trap or wfi.
+ * If bit `p` of `cpu->ecall` is set, an ecall from privilege `p` does not trap
+ * but stops with `RV_TRAP_ECALL` and the pc past it, so the host can service
+ * the call (e.g. the SBI) from the registers and resume.
+ * Pending interrupts are checked after the first instruction and after each
+ * SYSTEM instruction; the host may call `rv_irq` between runs or from the bus
+ * callback, and a changed interrupt is taken at the next check.
+ * Returns the trap cause, `RV_TRAP_WFI`, `RV_TRAP_ECALL`, or `RV_TRAP_NONE` if
+ * the budget was used up (or the RV_TRACE ring filled). Stores the number of
+ * instructions executed in `*ran` if not NULL. */
+rv_u32 rv_run(rv *cpu, rv_u32 budget, rv_u32 *ran);
+
+/* Trigger interrupt(s). Also updates the Sstc timer interrupt (stip, once
+ * menvcfg.stce is set) from `mtime`, as `rv_run` does on entry. */
 void rv_irq(rv *cpu, rv_cause cause);
 
+/* Expand the compressed instruction in the low 16 bits of `c` to its 32-bit
+ * equivalent. Returns 0 if it is illegal. */
+rv_u32 rv_decompress(rv_u32 c);
+
 /* Utility function to convert between host<->LE. */
 void rv_endcvt(rv_u8 *in, rv_u8 *out, rv_u32 width, rv_u32 is_store);
 
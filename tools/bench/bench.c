@@ -0,0 +1,132 @@
+#define _POSIX_C_SOURCE 199309L /* clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rv.h"
+
+/* usage: bench [-j] [-r reps] [-t hot] kernel.bin...
+ * runs each kernel `reps` times and reports the fastest run: guest MIPS, host
+ * ns and cycles per guest instruction, and whether the kernel's self check
+ * passed. -j prints one JSON object per kernel instead, for compare.py. */
+
+#define RAM_BASE 0x80000000
+#define RAM_SIZE 0x800000 /* the paged kernel keeps its data at +3 MiB */
+#define UART_BASE 0x10000000
+
+void die(const char *msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+static rv_u8 mem[RAM_SIZE], image[RAM_SIZE];
+
+/* ram (for page table walks) and a uart that is always ready to send */
+rv_res bus_cb(void *user, rv_u32 addr, rv_u8 *data, rv_u32 store,
+              rv_u32 width) {
+  rv_u8 *ptr = mem + (addr - RAM_BASE);
+  (void)user;
+  if (addr >= RAM_BASE && addr - RAM_BASE + width <= RAM_SIZE)
+    memcpy(store ? ptr : data, store ? data : ptr, width);
+  else if (addr >= UART_BASE && addr - UART_BASE < 8 && width == 1)
+    *data = store ? *data : addr == UART_BASE + 5 ? 0x60 : 0; /* lsr */
+  else
+    return RV_BAD;
+  return RV_OK;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* host cycles, or 0 where there is no cycle counter to read */
+static double cycles(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  unsigned int lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return (double)hi * 4294967296.0 + (double)lo;
+#else
+  return 0;
+#endif
+}
+
+typedef struct result {
+  double inst, sec, cyc; /* guest instructions, host seconds and cycles */
+  int ok;                /* the kernel ended with a0 == 0 */
+} result;
+
+/* run the kernel in `image` once */
+static result run(rv_u32 hot, size_t size) {
+  rv cpu;
+  result res;
+  rv_u32 v, ran;
+  double t, c;
+  memset(mem, 0, sizeof(mem)), memcpy(mem, image, size);
+  rv_init(&cpu, NULL, &bus_cb), cpu.hot = hot;
+  if (rv_map_ram(&cpu, RAM_BASE, RAM_SIZE, mem))
+    die("couldn't map ram");
+  res.inst = 0, t = now(), c = cycles();
+  do
+    v = rv_run(&cpu, 1 << 16, &ran), res.inst += ran;
+  while (v == RV_TRAP_NONE);
+  res.cyc = cycles() - c, res.sec = now() - t;
+  res.ok = (v == RV_EMECALL || v == RV_ESECALL) && !cpu.r[10];
+  return res;
+}
+
+int main(int argc, char **argv) {
+  FILE *f;
+  result best, res;
+  unsigned long reps = 5, i;
+  rv_u32 hot = 0;
+  size_t size;
+  int json = 0, fail = 0, ok, a;
+  char name[64], *end;
+  const char *base;
+  for (a = 1; a < argc && argv[a][0] == '-'; a++) {
+    if (!strcmp(argv[a], "-j"))
+      json = 1;
+    else if (!strcmp(argv[a], "-r") && a + 1 < argc)
+      reps = strtoul(argv[++a], &end, 10);
+    else if (!strcmp(argv[a], "-t") && a + 1 < argc)
+      hot = (rv_u32)strtoul(argv[++a], &end, 10);
+    else
+      die("usage: bench [-j] [-r reps] [-t hot] kernel.bin...");
+  }
+  if (!reps)
+    die("invalid number of repetitions");
+  if (!json)
+    printf("%-12s %12s %9s %9s %10s\n", "kernel", "instructions", "MIPS",
+           "ns/inst", "cyc/inst");
+  for (; a < argc; a++) {
+    if (!(f = fopen(argv[a], "rb")))
+      die("couldn't open kernel");
+    size = fread(image, 1, sizeof(image), f), fclose(f);
+    base = strrchr(argv[a], '/') ? strrchr(argv[a], '/') + 1 : argv[a];
+    sprintf(name, "%.63s", base);
+    if (strchr(name, '.'))
+      *strchr(name, '.') = 0;
+    for (i = 0, ok = 1; i < reps; i++) { /* keep the fastest run */
+      res = run(hot, size), ok &= res.ok;
+      if (!i || res.sec < best.sec)
+        best = res;
+    }
+    best.ok = ok, fail |= !ok;
+    if (json)
+      printf("{\"kernel\": \"%s\", \"instructions\": %.0f, "
+             "\"seconds\": %.6f, \"mips\": %.2f, \"ns_per_inst\": %.3f, "
+             "\"cycles_per_inst\": %.2f, \"ok\": %s}\n",
+             name, best.inst, best.sec, best.inst / best.sec / 1e6,
+             best.sec * 1e9 / best.inst, best.cyc / best.inst,
+             best.ok ? "true" : "false");
+    else
+      printf("%-12s %12.0f %9.2f %9.3f %10.2f%s\n", name, best.inst,
+             best.inst / best.sec / 1e6, best.sec * 1e9 / best.inst,
+             best.cyc / best.inst, best.ok ? "" : "  FAILED");
+  }
+  return fail ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,39 @@
+import json
+import sys
+
+# usage: python compare.py base.json new.json [threshold]
+# compares two `bench -j` results kernel by kernel, and fails if a kernel
+# failed its self check, is missing from the new results, or got more than
+# threshold (default 0.05) slower
+
+base_path, new_path = sys.argv[1], sys.argv[2]
+threshold = float(sys.argv[3]) if len(sys.argv) > 3 else 0.05
+
+
+def load(path):
+    with open(path) as f:
+        return {r["kernel"]: r for r in map(json.loads, filter(str.strip, f))}
+
+
+base, new, bad = load(base_path), load(new_path), 0
+
+print(f"{'kernel':<12} {'base MIPS':>10} {'new MIPS':>10} {'change':>8}")
+for name, r in new.items():
+    if not r["ok"]:
+        print(f"{name:<12} {'':>10} {'':>10} {'FAILED':>8}")
+        bad += 1
+        continue
+    if name not in base:
+        print(f"{name:<12} {'-':>10} {r['mips']:>10.2f} {'new':>8}")
+        continue
+    change = r["mips"] / base[name]["mips"] - 1
+    slower = change < -threshold
+    bad += slower
+    print(f"{name:<12} {base[name]['mips']:>10.2f} {r['mips']:>10.2f}", end="")
+    print(f" {change:>+7.1%}{'  REGRESSED' if slower else ''}")
+for name in base:
+    if name not in new:
+        print(f"{name:<12} {base[name]['mips']:>10.2f} {'-':>10}", end="")
+        print(f" {'MISSING':>8}")
+        bad += 1
+sys.exit(1 if bad else 0)
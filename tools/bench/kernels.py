@@ -0,0 +1,377 @@
+import struct
+
+# usage: python kernels.py
+# assembles the benchmark kernels into kernels/*.bin. each kernel runs in
+# m-mode from 0x80000000, checks its own result against one computed here,
+# and ends with an ecall with a0 = 0 if the result matched.
+
+BASE = 0x80000000
+DATA = 0x80100000  # scratch memory
+UART = 0x10000000  # the runner's uart: thr at +0, lsr at +5
+M32 = 0xFFFFFFFF
+
+# registers
+ZERO, RA, SP, T0, T1, T2, S0, S1 = 0, 1, 2, 5, 6, 7, 8, 9
+A0, A1, A2, A3, A4, A5 = 10, 11, 12, 13, 14, 15
+S2, S3, S4, S5, S6 = 18, 19, 20, 21, 22
+
+
+class Asm:
+    def __init__(s):
+        s.b, s.labels, s.fix = bytearray(), {}, []
+
+    def pc(s):
+        return BASE + len(s.b)
+
+    def w(s, x):
+        s.b += struct.pack("<I", x & M32)
+
+    def h(s, x):
+        s.b += struct.pack("<H", x & 0xFFFF)
+
+    def label(s, name):
+        s.labels[name] = s.pc()
+
+    # base formats
+    def r(s, op, f3, rd, rs1, rs2, f7):
+        s.w(f7 << 25 | rs2 << 20 | rs1 << 15 | f3 << 12 | rd << 7 | op)
+
+    def i(s, op, f3, rd, rs1, imm):
+        s.w((imm & 0xFFF) << 20 | rs1 << 15 | f3 << 12 | rd << 7 | op)
+
+    def s_(s, f3, rs1, rs2, imm):
+        s.w((imm >> 5 & 0x7F) << 25 | rs2 << 20 | rs1 << 15 | f3 << 12 |
+            (imm & 0x1F) << 7 | 0x23)
+
+    def u(s, op, rd, imm):
+        s.w(imm & 0xFFFFF000 | rd << 7 | op)
+
+    # branches and jumps to labels, patched by done()
+    def br(s, f3, rs1, rs2, name):
+        s.fix.append(("b", len(s.b), name)), s.w(f3 << 12 | rs2 << 20 |
+                                                  rs1 << 15 | 0x63)
+
+    def jal(s, rd, name):
+        s.fix.append(("j", len(s.b), name)), s.w(rd << 7 | 0x6F)
+
+    def cbnez(s, rs1, name):
+        s.fix.append(("c", len(s.b), name)), s.h(0xE001 | (rs1 - 8) << 7)
+
+    def la(s, rd, name):  # lui and addi of a label's address
+        s.fix.append(("a", len(s.b), name))
+        s.u(0x37, rd, 0), s.addi(rd, rd, 0)
+
+    def done(s):
+        for kind, at, name in s.fix:
+            off = (s.labels[name] - (BASE + at)) & M32
+            if kind == "a":
+                v = s.labels[name]
+                lo = (v & 0xFFF) - ((v & 0x800) << 1)
+                hi, add = struct.unpack_from("<II", s.b, at)
+                struct.pack_into("<II", s.b, at, hi | (v - lo) & 0xFFFFF000,
+                                 add | (lo & 0xFFF) << 20)
+            elif kind == "b":
+                x = struct.unpack_from("<I", s.b, at)[0] | \
+                    (off >> 12 & 1) << 31 | (off >> 5 & 0x3F) << 25 | \
+                    (off >> 1 & 0xF) << 8 | (off >> 11 & 1) << 7
+                struct.pack_into("<I", s.b, at, x)
+            elif kind == "j":
+                x = struct.unpack_from("<I", s.b, at)[0] | \
+                    (off >> 20 & 1) << 31 | (off >> 1 & 0x3FF) << 21 | \
+                    (off >> 11 & 1) << 20 | (off >> 12 & 0xFF) << 12
+                struct.pack_into("<I", s.b, at, x)
+            else:
+                x = struct.unpack_from("<H", s.b, at)[0] | \
+                    (off >> 8 & 1) << 12 | (off >> 3 & 3) << 10 | \
+                    (off >> 6 & 3) << 5 | (off >> 1 & 3) << 3 | \
+                    (off >> 5 & 1) << 2
+                struct.pack_into("<H", s.b, at, x)
+        return bytes(s.b)
+
+    # instructions
+    def li(s, rd, v):
+        v &= M32
+        lo = (v & 0xFFF) - ((v & 0x800) << 1)
+        s.u(0x37, rd, (v - lo) & M32), s.addi(rd, rd, lo)
+
+    def addi(s, rd, rs1, imm): s.i(0x13, 0, rd, rs1, imm)
+    def andi(s, rd, rs1, imm): s.i(0x13, 7, rd, rs1, imm)
+    def ori(s, rd, rs1, imm): s.i(0x13, 6, rd, rs1, imm)
+    def slli(s, rd, rs1, sh): s.i(0x13, 1, rd, rs1, sh)
+    def srli(s, rd, rs1, sh): s.i(0x13, 5, rd, rs1, sh)
+    def add(s, rd, a, b): s.r(0x33, 0, rd, a, b, 0)
+    def sub(s, rd, a, b): s.r(0x33, 0, rd, a, b, 0x20)
+    def xor(s, rd, a, b): s.r(0x33, 4, rd, a, b, 0)
+    def sltu(s, rd, a, b): s.r(0x33, 3, rd, a, b, 0)
+    def m(s, f3, rd, a, b): s.r(0x33, f3, rd, a, b, 1)  # mul .. remu
+    def lw(s, rd, rs1, imm): s.i(0x03, 2, rd, rs1, imm)
+    def lbu(s, rd, rs1, imm): s.i(0x03, 4, rd, rs1, imm)
+    def sw(s, rs2, rs1, imm): s.s_(2, rs1, rs2, imm)
+    def sb(s, rs2, rs1, imm): s.s_(0, rs1, rs2, imm)
+    def amo(s, f5, rd, rs1, rs2): s.r(0x2F, 2, rd, rs1, rs2, f5 << 2)
+    def csrw(s, csr, rs1): s.i(0x73, 1, 0, rs1, csr)
+    def csrs(s, csr, rs1): s.i(0x73, 2, 0, rs1, csr)
+    def bne(s, a, b, name): s.br(1, a, b, name)
+    def beq(s, a, b, name): s.br(0, a, b, name)
+    def ecall(s): s.w(0x73)
+    def mret(s): s.w(0x30200073)
+
+    # compressed instructions, on x8-x15 where the format needs it
+    def cmv(s, rd, rs2): s.h(0x8002 | rd << 7 | rs2 << 2)
+    def cadd(s, rd, rs2): s.h(0x9002 | rd << 7 | rs2 << 2)
+    def caddi(s, rd, imm): s.h((imm >> 5 & 1) << 12 | rd << 7 |
+                               (imm & 31) << 2 | 1)
+    def cslli(s, rd, sh): s.h(rd << 7 | sh << 2 | 2)
+    def csrli(s, rd, sh): s.h(0x8001 | (rd - 8) << 7 | sh << 2)
+    def cxor(s, rd, rs2): s.h(0x8C21 | (rd - 8) << 7 | (rs2 - 8) << 2)
+    def clw(s, rd, rs1, off): s.h(0x4000 | (off >> 3 & 7) << 10 |
+                                  (rs1 - 8) << 7 | (off >> 2 & 1) << 6 |
+                                  (off >> 6 & 1) << 5 | (rd - 8) << 2)
+    def csw(s, rs2, rs1, off): s.h(0xC000 | (off >> 3 & 7) << 10 |
+                                   (rs1 - 8) << 7 | (off >> 2 & 1) << 6 |
+                                   (off >> 6 & 1) << 5 | (rs2 - 8) << 2)
+
+    # a0 <- a0 - expected, then stop
+    def check(s, expected):
+        s.li(T0, expected), s.sub(A0, A0, T0), s.ecall()
+
+    # x ^= x << a; x ^= x >> b; x ^= x << c, with t0 as scratch
+    def xorshift(s, x, a=13, b=17, c=5):
+        s.slli(T0, x, a), s.xor(x, x, T0)
+        s.srli(T0, x, b), s.xor(x, x, T0)
+        s.slli(T0, x, c), s.xor(x, x, T0)
+
+
+def xorshift(x, a=13, b=17, c=5):
+    x ^= x << a & M32
+    x ^= x >> b
+    return x ^ (x << c & M32)
+
+
+def sgn(x):
+    return x - (1 << 32) if x >> 31 else x
+
+
+def div(a, b):  # rv32 div, divisor never 0 here
+    if a == 0x80000000 and b == M32:
+        return a
+    q = abs(sgn(a)) // abs(sgn(b))
+    return (-q if (sgn(a) < 0) != (sgn(b) < 0) else q) & M32
+
+
+def mulh(a, b):
+    return (sgn(a) * sgn(b)) >> 32 & M32
+
+
+def alu():
+    """shifts, xors, adds and compares"""
+    n, a = 2000000, Asm()
+    a.li(S1, 12345), a.li(A0, 0), a.li(T1, n)
+    a.label("loop")
+    a.xorshift(S1)
+    a.add(A0, A0, S1), a.sltu(T2, A0, S1), a.add(A0, A0, T2)  # end-around
+    a.addi(T1, T1, -1), a.bne(T1, ZERO, "loop")
+    x, acc = 12345, 0
+    for _ in range(n):
+        x = xorshift(x)
+        acc = (acc + x) & M32
+        acc = (acc + (acc < x)) & M32
+    a.check(acc)
+    return a.done()
+
+
+def muldiv():
+    """mul, mulh, mulhu, div, divu and remu"""
+    n, a = 800000, Asm()
+    a.li(S1, 99991), a.li(A0, 1), a.li(T1, n)
+    a.label("loop")
+    a.xorshift(S1)
+    a.m(0, T0, S1, S1), a.add(A0, A0, T0)  # mul
+    a.m(3, T0, S1, A0), a.xor(A0, A0, T0)  # mulhu
+    a.ori(T2, S1, 1)
+    a.m(5, T0, A0, T2), a.add(A0, A0, T0)  # divu
+    a.m(7, T0, A0, T2), a.sub(A0, A0, T0)  # remu
+    a.m(4, T0, A0, T2), a.xor(A0, A0, T0)  # div
+    a.m(1, T0, A0, S1), a.add(A0, A0, T0)  # mulh
+    a.addi(T1, T1, -1), a.bne(T1, ZERO, "loop")
+    x, acc = 99991, 1
+    for _ in range(n):
+        x = xorshift(x)
+        acc = (acc + x * x) & M32
+        acc ^= x * acc >> 32
+        d = x | 1
+        acc = (acc + acc // d) & M32
+        acc = (acc - acc % d) & M32
+        acc ^= div(acc, d)
+        acc = (acc + mulh(acc, x)) & M32
+    a.check(acc)
+    return a.done()
+
+
+def memcpy():
+    """word copies of a 64KiB buffer, unrolled by 4"""
+    words, reps, a = 0x4000, 400, Asm()
+    src, dst = DATA, DATA + 0x10000
+    a.li(S1, 7), a.li(S2, src), a.li(T1, words)  # fill the source
+    a.label("fill")
+    a.xorshift(S1), a.sw(S1, S2, 0), a.addi(S2, S2, 4)
+    a.addi(T1, T1, -1), a.bne(T1, ZERO, "fill")
+    a.li(S3, reps)
+    a.label("rep")
+    a.li(S2, src), a.li(S4, dst), a.li(S5, src + words * 4)
+    a.label("copy")
+    for k in range(4):
+        a.lw(A1 + k, S2, k * 4)
+    for k in range(4):
+        a.sw(A1 + k, S4, k * 4)
+    a.addi(S2, S2, 16), a.addi(S4, S4, 16), a.bne(S2, S5, "copy")
+    a.addi(S3, S3, -1), a.bne(S3, ZERO, "rep")
+    a.li(A0, 0), a.li(S4, dst), a.li(T1, words)  # sum the destination
+    a.label("sum")
+    a.lw(T2, S4, 0), a.add(A0, A0, T2), a.addi(S4, S4, 4)
+    a.addi(T1, T1, -1), a.bne(T1, ZERO, "sum")
+    x, acc = 7, 0
+    for _ in range(words):
+        x = xorshift(x)
+        acc = (acc + x) & M32
+    a.check(acc)
+    return a.done()
+
+
+def branchy():
+    """collatz sequences: data dependent branches"""
+    n, a = 30000, Asm()
+    a.li(A0, 0), a.li(S1, 1), a.li(S2, n + 1), a.li(S3, 1)
+    a.label("next")
+    a.addi(T1, S1, 0)
+    a.label("step")
+    a.beq(T1, S3, "done")
+    a.addi(A0, A0, 1), a.andi(T0, T1, 1), a.bne(T0, ZERO, "odd")
+    a.srli(T1, T1, 1), a.jal(ZERO, "step")
+    a.label("odd")
+    a.slli(T2, T1, 1), a.add(T1, T1, T2), a.addi(T1, T1, 1)
+    a.jal(ZERO, "step")
+    a.label("done")
+    a.addi(S1, S1, 1), a.bne(S1, S2, "next")
+    steps = 0
+    for k in range(1, n + 1):
+        while k != 1:
+            k, steps = (k >> 1 if k % 2 == 0 else 3 * k + 1), steps + 1
+    a.check(steps)
+    return a.done()
+
+
+def compressed():
+    """a loop of nothing but compressed instructions"""
+    n, a = 1300000, Asm()
+    a.li(S0, DATA), a.li(S1, n), a.li(A0, 0), a.li(A1, 4242)
+    a.sw(ZERO, S0, 4)
+    a.label("loop")
+    for op, sh in ((a.cslli, 7), (a.csrli, 9), (a.cslli, 8)):
+        a.cmv(A2, A1), op(A2, sh), a.cxor(A1, A2)
+    a.csw(A1, S0, 0), a.clw(A3, S0, 4), a.cadd(A0, A3), a.csw(A0, S0, 4)
+    a.cadd(A0, A1), a.caddi(S1, -1), a.cbnez(S1, "loop")
+    x, acc, mem = 4242, 0, 0
+    for _ in range(n):
+        x = xorshift(x, 7, 9, 8)
+        acc = (acc + mem) & M32
+        mem = acc
+        acc = (acc + x) & M32
+    a.check(acc)
+    return a.done()
+
+
+def paged():
+    """s-mode pointer chasing through 256 sv32 pages, more than the tlb"""
+    pages, n, a = 256, 8000000, Asm()
+    root, l0, phys, virt = 0x80200000, 0x80201000, 0x80300000, 0x40000000
+    # l0[i] maps virtual page i to physical page i * 167 % 256
+    a.li(S2, l0), a.li(T1, 0), a.li(S3, pages), a.li(S4, 167)
+    a.label("pte")
+    a.m(0, T2, T1, S4), a.andi(T2, T2, pages - 1)
+    a.li(T0, phys >> 12), a.add(T2, T2, T0), a.slli(T2, T2, 10)
+    a.ori(T2, T2, 0xC7)  # d a w r v
+    a.sw(T2, S2, 0), a.addi(S2, S2, 4)
+    a.addi(T1, T1, 1), a.bne(T1, S3, "pte")
+    a.li(S2, root)
+    a.li(T2, (BASE >> 12) << 10 | 0xCF), a.li(T0, 0x200 * 4)  # code megapage
+    a.add(T0, T0, S2), a.sw(T2, T0, 0)
+    a.li(T2, (l0 >> 12) << 10 | 1), a.sw(T2, S2, 0x100 * 4)
+    a.li(T0, 0x80000000 | root >> 12), a.csrw(0x180, T0)  # satp
+    a.li(T0, 1 << 11), a.csrs(0x300, T0)  # mpp = s
+    a.la(T0, "s"), a.csrw(0x341, T0), a.mret()  # mepc = s
+    a.label("s")
+    # node k is on virtual page k * 97 % 256, at line k % 64, and points to
+    # node k + 1
+    a.li(T1, 0), a.li(S5, 97), a.li(S6, virt)
+    a.label("node")
+    for t, k in ((A1, T1), (A2, T2)):
+        if t == A2:
+            a.addi(T2, T1, 1), a.andi(T2, T2, pages - 1)
+        a.m(0, t, k, S5), a.andi(t, t, pages - 1), a.slli(t, t, 12)
+        a.andi(T0, k, 63), a.slli(T0, T0, 6), a.add(t, t, T0)
+        a.add(t, t, S6)
+    a.sw(A2, A1, 0)
+    a.addi(T1, T1, 1), a.bne(T1, S3, "node")
+    a.li(A0, 0), a.addi(A1, S6, 0), a.li(T1, n // 4)
+    a.label("chase")
+    for _ in range(4):
+        a.lw(A1, A1, 0), a.add(A0, A0, A1)
+    a.addi(T1, T1, -1), a.bne(T1, ZERO, "chase")
+
+    def node(k):
+        return virt + (k * 97 % pages << 12) + (k % 64 << 6)
+    acc = sum(node((k + 1) % pages) for k in range(n)) & M32
+    a.check(acc)
+    return a.done()
+
+
+def amo():
+    """amoadd, amoswap, amoxor and an lr/sc increment"""
+    n, a = 1000000, Asm()
+    a.li(S0, DATA), a.addi(S2, S0, 4), a.addi(S3, S0, 8), a.addi(S4, S0, 12)
+    for r in (S0, S2, S3, S4):
+        a.sw(ZERO, r, 0)
+    a.li(A0, 0), a.li(T1, n), a.li(S5, 3)
+    a.label("loop")
+    a.amo(0, T0, S0, S5), a.add(A0, A0, T0)  # amoadd.w
+    a.amo(1, T0, S2, T1), a.add(A0, A0, T0)  # amoswap.w
+    a.label("retry")
+    a.amo(2, T0, S3, ZERO), a.addi(T0, T0, 5)  # lr.w
+    a.amo(3, T2, S3, T0), a.bne(T2, ZERO, "retry")  # sc.w
+    a.add(A0, A0, T0)
+    a.amo(4, T0, S4, A0), a.xor(A0, A0, T0)  # amoxor.w
+    a.addi(T1, T1, -1), a.bne(T1, ZERO, "loop")
+    acc, w = 0, [0, 0, 0, 0]
+    for k in range(n, 0, -1):
+        acc, w[0] = (acc + w[0]) & M32, (w[0] + 3) & M32
+        acc, w[1] = (acc + w[1]) & M32, k
+        w[2] = (w[2] + 5) & M32
+        acc = (acc + w[2]) & M32
+        acc, w[3] = acc ^ w[3], w[3] ^ acc
+    a.check(acc)
+    return a.done()
+
+
+def uart():
+    """bytes written to a uart, polling its line status before each"""
+    n, a = 2500000, Asm()
+    a.li(S0, UART), a.li(A0, 0), a.li(A1, 0), a.li(T1, n)
+    a.label("poll")
+    a.lbu(T0, S0, 5), a.andi(T0, T0, 0x20), a.beq(T0, ZERO, "poll")
+    a.sb(A1, S0, 0), a.add(A0, A0, A1)
+    a.addi(A1, A1, 7), a.andi(A1, A1, 0xFF)
+    a.addi(T1, T1, -1), a.bne(T1, ZERO, "poll")
+    acc, b = 0, 0
+    for _ in range(n):
+        acc, b = acc + b, (b + 7) & 0xFF
+    a.check(acc)
+    return a.done()
+
+
+KERNELS = [alu, muldiv, memcpy, branchy, compressed, paged, amo, uart]
+
+if __name__ == "__main__":
+    for k in KERNELS:
+        with open(f"kernels/{k.__name__}.bin", "wb") as f:
+            f.write(k())
@@ -0,0 +1 @@
+../../rv.c
\ No newline at end of file
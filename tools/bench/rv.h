@@ -0,0 +1 @@
+../../rv.h
\ No newline at end of file
@@ -0,0 +1,127 @@
+# Generate the device tree for mach with a given number of harts.
+# usage: python3 dts.py [-n harts] [-t timebase] > extern/rv.dts
+from argparse import ArgumentParser
+
+HEAD = """/dts-v1/;
+
+/ {
+	#address-cells = <1>;
+	#size-cells = <1>;
+	compatible = "maxnu,rv32";
+
+	aliases {
+		serial0 = &uart0;
+		serial1 = &uart1;
+	};
+
+	chosen {
+		bootargs = "earlycon=sifive,0x3000000 console=ttySIF0";
+		stdout-path = "/soc/serial@3000000";
+	};
+
+	memory@80000000 {
+		device_type = "memory";
+		reg = <0x80000000 0x8000000>;
+	};
+
+	timer: timer@0 {
+		#clock-cells = <0>;
+		compatible = "riscv", "riscv,timer";
+		interrupts-extended = <%(timer)s>;
+		reg = <0>;
+	};
+
+	hfclk: hfclk {
+		#clock-cells = <0>;
+		compatible = "fixed-clock";
+		clock-frequency = <33333333>;
+		clock-output-names = "hfclk";
+	};
+
+	cpus {
+		#address-cells = <1>;
+		#size-cells = <0>;
+		timebase-frequency = <%(timebase)d>;
+"""
+
+CPU = """		cpu@%(i)d {
+			device_type = "cpu";
+			reg = <%(i)d>;
+			status = "okay";
+			compatible = "riscv";
+			riscv,isa = "rv32imac_sstc";
+			clock-frequency = <0>;
+
+			intc%(i)d: interrupt-controller {
+				#interrupt-cells = <1>;
+				compatible = "riscv,cpu-intc";
+				interrupt-controller;
+			};
+		};
+"""
+
+TAIL = """	};
+
+	soc {
+		#address-cells = <1>;
+		#size-cells = <1>;
+		compatible = "simple-bus";
+		ranges;
+
+		clint: clint@2000000 {
+			#interrupt-cells = <1>;
+			compatible = "riscv,clint0";
+			reg = <0x2000000 0xC000>;
+			interrupts-extended = <%(clint)s>;
+		};
+
+		plic: interrupt-controller@c000000 {
+			#address-cells = <0>;
+			#interrupt-cells = <1>;
+			#size-cells = <1>;
+			compatible = "riscv,plic0";
+			reg = <0xC000000 0x4000000>;
+			interrupts-extended = <%(plic)s>;
+			riscv,ndev = <32>;
+			interrupt-controller;
+		};
+
+		uart0: serial@3000000 {
+			compatible = "sifive,uart0";
+			reg = <0x3000000 0x20>;
+			interrupt-parent = <&plic>;
+			interrupts = <1>;
+			clocks = <&hfclk>;
+			no-loopback-test;
+		};
+
+		uart1: serial@6000000 {
+			compatible = "sifive,uart0";
+			reg = <0x6000000 0x20>;
+			interrupt-parent = <&plic>;
+			interrupts = <2>;
+			clocks = <&hfclk>;
+			no-loopback-test;
+		};
+	};
+};
+"""
+
+
+def irqs(harts, *irq):
+    """interrupts-extended cells for each irq on each hart's controller"""
+    return " ".join("&intc%d %d" % (i, n) for i in range(harts) for n in irq)
+
+
+if __name__ == "__main__":
+    ap = ArgumentParser()
+    ap.add_argument("-n", "--harts", type=int, default=1,
+                    choices=range(1, 9))  # up to MACH_HARTS in mach.c
+    ap.add_argument("-t", "--timebase", type=int, default=1000)  # mach -t
+    args = ap.parse_args()
+    n = args.harts
+    # clint: msi (3) and mti (7) per hart, plic: one s-mode context per hart
+    print(HEAD % {"timer": irqs(n, 5), "timebase": args.timebase}, end="")
+    for i in range(n):
+        print(CPU % {"i": i}, end="")
+    print(TAIL % {"clint": irqs(n, 3, 7), "plic": irqs(n, 9)}, end="")
@@ -1,66 +1,306 @@
+#define _POSIX_C_SOURCE 200112L /* getopt, pthreads, mmap, sockets */
+#define _DEFAULT_SOURCE         /* MAP_ANONYMOUS, MADV_HUGEPAGE */
+
 #include <curses.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "rv.h"
 #include "rv_clint.h"
+#include "rv_mmio.h"
 #include "rv_plic.h"
+#include "rv_prof.h"
+#include "rv_sched.h"
 #include "rv_uart.h"
+#ifdef RV_TRACE
+#include "rv_trace.h"
+#endif
 
 #define MACH_RAM_BASE 0x80000000UL
-#define MACH_RAM_SIZE (1024UL * 1024UL * 128UL) /* 128MiB of ram */
+#define MACH_RAM_SIZE 128UL                     /* default MiB of ram */
+#define MACH_RAM_MAX 2048UL                     /* most MiB of ram */
 #define MACH_DTB_OFFSET 0x2000000UL             /* dtb is @32MiB */
+#define MACH_DTB_MAX 0x100000UL                 /* largest dtb to patch */
+#define MACH_HUGE 0x200000UL                    /* host huge page size */
 
 #define MACH_PLIC0_BASE 0xC000000UL  /* plic0 base address */
 #define MACH_CLINT0_BASE 0x2000000UL /* clint0 base address */
 #define MACH_UART0_BASE 0x3000000UL  /* uart0 base address */
 #define MACH_UART1_BASE 0x6000000UL  /* uart1 base address */
 
-typedef struct mach {
+#define MACH_HARTS RV_CLINT_NHART /* maximum number of harts */
+#define MACH_SYNC 64 /* most instructions per run with >1 hart */
+
+#define MACH_RTC_PERIOD 0x1000 /* instructions per mtime update */
+#define MACH_UART_IDLE 0x1000  /* instructions between idle uart rx polls */
+#define MACH_IDLE_MAX 100      /* most milliseconds to sleep in wfi */
+#define MACH_IDLE_SKIP 0x40000 /* most mtime ticks to skip per wfi with -d */
+#define MACH_TIMEBASE 1000     /* default mtime ticks per second, see rv.dts */
+#define MACH_PROF_PERIOD 10007 /* default instructions per profile sample */
+#define MACH_TRACE_RING 0x10000 /* records in each hart's trace ring */
+
+#define MACH_SNAP_VERSION 4       /* bump when the snapshot layout changes */
+#define MACH_SNAP_ALIGN 0x10000UL /* ram offset in snapshots, for mmap */
+
+#define MACH_EV_RTC 0   /* mtime tick */
+#define MACH_EV_UART0 1 /* uart0 transfer, uart1 follows */
+
+#define MACH_SSIP 0x2        /* mip: supervisor software interrupt */
+#define MACH_STIP 0x20       /* mip: supervisor timer interrupt */
+#define MACH_STCE 0x80000000 /* menvcfgh: stimecmp enable (sstc) */
+
+#define MACH_SBI_BASE 0x10          /* sbi base extension */
+#define MACH_SBI_TIME 0x54494D45    /* sbi timer extension, "TIME" */
+#define MACH_SBI_IPI 0x735049       /* sbi ipi extension, "sPI" */
+#define MACH_SBI_RFNC 0x52464E43    /* sbi remote fence extension, "RFNC" */
+#define MACH_SBI_IMPL 0x6D616368    /* sbi implementation id, "mach" */
+#define MACH_SBI_ENOTSUP 0xFFFFFFFE /* sbi error: not supported (-2) */
+
+typedef struct mach_hart {
+  struct mach *m;
   rv *cpu;
+  rv_u32 left; /* instructions until the next profile sample */
+} mach_hart;
+
+typedef struct mach {
+  mach_hart hart[MACH_HARTS];
+  rv_u32 harts;
+  rv_u32 irq[MACH_HARTS]; /* interrupt lines of each hart */
+  rv_u32 now;             /* machine time, in instructions run by hart 0 */
+  rv_u32 uart_at[2];      /* machine time each uart was last clocked */
+  rv_sched sched;         /* device events, keyed by machine time */
+  rv_u32 timebase;        /* mtime ticks per second of host time */
+  int det;                /* mtime ticks every MACH_RTC_PERIOD instructions */
+  int sbi;                /* the host implements the sbi, see mach_sbi */
+  int halt;               /* the guest shut the machine down */
+  rv_u32 fence[MACH_HARTS]; /* remote fences each hart has yet to carry out */
+  struct timespec start;  /* host time when the harts started */
+  double epoch;           /* mtime when the harts started */
+  unsigned long idle;     /* mtime ticks hart 0 spent in wfi */
+  int in, out;            /* host fds behind uart0, or stdin for curses */
+  int headless;           /* uart0 is on stdin and stdout, without curses */
+  const char *marker;     /* stop once uart0 has written this, if not NULL */
+  char *seen;             /* the last strlen(marker) bytes uart0 wrote */
+  int found;              /* uart0 wrote the marker */
+  size_t ninst;         /* hart 0 stops once past this many, or never if 0 */
+  size_t ran;           /* instructions run by hart 0 */
+  int done;             /* set once hart 0 has run past ninst */
+  pthread_mutex_t lock; /* serializes device accesses between harts */
   rv_u8 *ram;
+  rv_u32 ram_size;
+  rv_mmio bus;
   rv_plic plic0;
   rv_clint clint0;
   rv_uart uart0, uart1;
+  rv_prof prof;  /* call stacks sampled from every hart */
+  rv_u32 period; /* instructions per profile sample, or 0 if not profiling */
+#ifdef RV_TRACE
+  rv_trace_file trace;  /* where mach_drain moves the harts' trace records */
+  int tracing;          /* mach_drain runs until this is cleared */
+  unsigned long traced; /* records moved */
+#endif
 } mach;
 
-/* machine general bus access */
+/* take the device lock, which is only needed with more than one hart */
+void mach_lock(mach *m) {
+  if (m->harts > 1)
+    pthread_mutex_lock(&m->lock);
+}
+
+void mach_unlock(mach *m) {
+  if (m->harts > 1)
+    pthread_mutex_unlock(&m->lock);
+}
+
+/* recompute the interrupt lines of every hart after a device changed state */
+void mach_irq(mach *m) {
+  rv_u32 h;
+  for (h = 0; h < m->harts; h++)
+    m->irq[h] = RV_CSI * rv_clint_msi(&m->clint0, h) |
+                RV_CTI * rv_clint_mti(&m->clint0, h) |
+                RV_CEI * rv_plic_mei(&m->plic0, h);
+}
+
+/* hand hart `h` its interrupt lines. with the sbi in the host there is no
+ * m-mode software to forward the clint's interrupts, so the clint's timer
+ * drives stip (unless sstc does) and its software interrupt is latched into
+ * ssip. a hart also carries out the remote fences it has been sent here. */
+void mach_hartirq(mach *m, rv_u32 h) {
+  rv *cpu = m->hart[h].cpu;
+  rv_irq(cpu, m->irq[h]);
+  if (!m->sbi)
+    return;
+  if (!(cpu->csr.menvcfgh & MACH_STCE)) {
+    cpu->csr.mip &= ~(rv_u32)MACH_STIP;
+    cpu->csr.mip |= MACH_STIP * rv_clint_mti(&m->clint0, h);
+  }
+  if (m->clint0.mswi[h])
+    m->clint0.mswi[h] = 0, cpu->csr.mip |= MACH_SSIP;
+  if (m->fence[h])
+    m->fence[h] = 0, rv_flush(cpu);
+}
+
+/* clock uart `u` up to the machine time, then schedule its next transfer: a
+ * `div` away while it has data to send, otherwise an rx poll */
+void mach_uart(mach *m, rv_u32 u) {
+  rv_uart *uart = u ? &m->uart1 : &m->uart0;
+  rv_u32 busy = (uart->txctrl & 1) && uart->tx.size;
+  if (rv_uart_update(uart, m->now - m->uart_at[u]))
+    rv_plic_irq(&m->plic0, u + 1);
+  m->uart_at[u] = m->now;
+  rv_sched_set(&m->sched, MACH_EV_UART0 + u,
+               m->now + (busy ? rv_uart_next(uart) : MACH_UART_IDLE));
+}
+
+/* set mtime from the host's monotonic clock, scaled to the timebase */
+void mach_clock(mach *m) {
+  rv *cpu = m->hart[0].cpu;
+  struct timespec t;
+  double ticks;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  ticks = m->epoch + ((double)(t.tv_sec - m->start.tv_sec) +
+                      (double)(t.tv_nsec - m->start.tv_nsec) / 1e9) *
+                         m->timebase;
+  cpu->csr.mtimeh = (rv_u32)(ticks / 4294967296.0);
+  cpu->csr.mtime = (rv_u32)(ticks - cpu->csr.mtimeh * 4294967296.0);
+}
+
+/* run the device events that are due at the machine time */
+void mach_events(mach *m) {
+  rv *cpu = m->hart[0].cpu;
+  rv_u32 ev, fired = 0;
+  while ((ev = rv_sched_pop(&m->sched, m->now)) != RV_SCHED_NONE) {
+    if (ev == MACH_EV_RTC) {
+      if (!m->det)
+        mach_clock(m);
+      else if (!++cpu->csr.mtime)
+        cpu->csr.mtimeh++;
+      rv_sched_set(&m->sched, ev, m->sched.when[ev] + MACH_RTC_PERIOD);
+    } else {
+      mach_uart(m, ev - MACH_EV_UART0);
+    }
+    fired = 1;
+  }
+  if (fired)
+    mach_irq(m);
+}
+
+/* hart 0 waits for an interrupt with no uart sending. deterministic mode
+ * skips machine time up to the next timer deadline, that of stimecmp if sstc
+ * is on, else the clint's, at most MACH_IDLE_SKIP ticks at a time so machine
+ * time doesn't wrap past the scheduler's deadlines; otherwise, sleep on uart0
+ * input until the deadline in host time. */
+void mach_idle(mach *m) {
+  rv *cpu = m->hart[0].cpu;
+  rv_u32 sstc = (cpu->csr.menvcfgh & MACH_STCE) && (cpu->csr.mie & MACH_STIP);
+  rv_u32 cmp = sstc ? cpu->csr.stimecmp : m->clint0.mtimecmp[0];
+  rv_u32 cmph = sstc ? cpu->csr.stimecmph : m->clint0.mtimecmph[0];
+  rv_u32 ticks = 0 /* until the deadline */, ms = MACH_IDLE_MAX;
+  rv_u32 mtime = cpu->csr.mtime;
+  struct pollfd in;
+  if (((m->uart0.txctrl & 1) && m->uart0.tx.size) ||
+      ((m->uart1.txctrl & 1) && m->uart1.tx.size))
+    return;
+  if ((sstc || (cpu->csr.mie & (m->sbi ? MACH_STIP : RV_CTI))) &&
+      ((cmph == cpu->csr.mtimeh && cmp > mtime) ||
+       (cmph == cpu->csr.mtimeh + 1 && cmp < mtime)))
+    ticks = cmp - mtime;
+  if (m->det && ticks) {
+    ticks = ticks > MACH_IDLE_SKIP ? MACH_IDLE_SKIP : ticks;
+    m->idle += ticks;
+    m->now = m->sched.when[MACH_EV_RTC] + (ticks - 1) * MACH_RTC_PERIOD;
+    mach_events(m);
+    return;
+  }
+  if (!m->det && ticks && ticks * 1000.0 / m->timebase < MACH_IDLE_MAX)
+    ms = (rv_u32)(ticks * 1000.0 / m->timebase) + 1; /* round up */
+  in.fd = m->uart0.rxctrl & 1 ? m->in : -1, in.events = POLLIN;
+  poll(&in, 1, (int)ms);
+  if (!m->det) { /* catch mtime up at the next update */
+    m->now = m->sched.when[MACH_EV_RTC];
+    mach_events(m);
+    m->idle += cpu->csr.mtime - mtime;
+  }
+}
+
+/* machine general bus access: ram (page table walks, since the harts map ram
+ * directly), or a device shared by all harts */
 rv_res mach_bus(void *user, rv_u32 addr, rv_u8 *data, rv_u32 store,
                 rv_u32 width) {
-  mach *m = (mach *)user;
-  if (addr >= MACH_RAM_BASE && addr < MACH_RAM_BASE + MACH_RAM_SIZE) {
+  mach_hart *hart = (mach_hart *)user;
+  mach *m = hart->m;
+  rv_res err;
+  if (addr - MACH_RAM_BASE < m->ram_size) {
     rv_u8 *ram = m->ram + addr - MACH_RAM_BASE;
     memcpy(store ? ram : data, store ? data : ram, width);
     return RV_OK;
-  } else if (addr >= MACH_PLIC0_BASE && addr < MACH_PLIC0_BASE + RV_PLIC_SIZE) {
-    return rv_plic_bus(&m->plic0, addr - MACH_PLIC0_BASE, data, store, width);
-  } else if (addr >= MACH_CLINT0_BASE &&
-             addr < MACH_CLINT0_BASE + RV_CLINT_SIZE) {
-    return rv_clint_bus(&m->clint0, addr - MACH_CLINT0_BASE, data, store,
-                        width);
-  } else if (addr >= MACH_UART0_BASE && addr < MACH_UART0_BASE + RV_UART_SIZE) {
-    return rv_uart_bus(&m->uart0, addr - MACH_UART0_BASE, data, store, width);
-  } else if (addr >= MACH_UART1_BASE && addr < MACH_UART1_BASE + RV_UART_SIZE) {
-    return rv_uart_bus(&m->uart1, addr - MACH_UART1_BASE, data, store, width);
-  } else {
-    return RV_BAD;
   }
+  mach_lock(m);
+  if (!m->det && hart == m->hart)
+    mach_clock(m); /* hart 0 reads the clint's mtime at the host's time */
+  if ((err = rv_mmio_bus(&m->bus, addr, data, store, width)) == RV_OK) {
+    mach_uart(m, 0), mach_uart(m, 1); /* reschedule after fifo/ctrl changes */
+    mach_irq(m);
+    mach_hartirq(m, hart->cpu->csr.mhartid);
+  }
+  mach_unlock(m);
+  return err;
 }
 
 /* uart0 I/O callback */
 rv_res uart0_io(void *user, rv_u8 *byte, rv_u32 write) {
   int ch;
-  static int thrott = 0; /* prevent getch() from being called too much */
   (void)user;
   if (write && *byte != '\r') /* curses bugs out if we echo '\r' */
     echochar(*byte);
-  else if (!write && ((thrott = (thrott + 1) & 0xFFF) || (ch = getch()) == ERR))
+  else if (!write && (ch = getch()) == ERR)
     return RV_BAD;
   else if (!write)
     *byte = (rv_u8)ch;
   return RV_OK;
 }
 
+/* look for the marker in what uart0 writes, and stop the machine at it */
+void mach_watch(mach *m, rv_u8 byte) {
+  size_t len = strlen(m->marker);
+  memmove(m->seen, m->seen + 1, len - 1);
+  m->seen[len - 1] = (char)byte;
+  if (!memcmp(m->seen, m->marker, len))
+    m->found = m->done = 1;
+}
+
+/* uart0 I/O callback over host fds, for the fork server and headless runs: a
+ * failed write stops the machine, as does a fork server's connection hanging
+ * up. headless, the end of stdin only stops input. */
+rv_res mach_fdio(void *user, rv_u8 *byte, rv_u32 is_write) {
+  mach *m = (mach *)user;
+  struct pollfd in;
+  if (is_write) {
+    if (write(m->out, byte, 1) != 1)
+      m->done = 1;
+    if (m->marker)
+      mach_watch(m, *byte);
+    return RV_OK;
+  }
+  in.fd = m->in, in.events = POLLIN;
+  if (m->in < 0 || poll(&in, 1, 0) < 1)
+    return RV_BAD;
+  if (read(m->in, byte, 1) == 1)
+    return RV_OK;
+  m->in = -1, m->done |= !m->headless; /* hung up */
+  return RV_BAD;
+}
+
 /* uart1 I/O callback */
 rv_res uart1_io(void *user, rv_u8 *byte, rv_u32 write) {
   (void)user, (void)byte, (void)write;
@@ -68,6 +308,501 @@ rv_res uart1_io(void *user, rv_u8 *byte, rv_u32 write) {
   return RV_BAD; /* stubbed for now */
 }
 
+/* a snapshot is a header, each hart's rv, the plic, clint, both uarts and the
+ * scheduler, then ram at the next MACH_SNAP_ALIGN boundary. checkpoints may
+ * follow, each a header, harts and devices, then `pages` page numbers and the
+ * contents of those pages. */
+typedef struct mach_snap {
+  char magic[8]; /* "rvsnap" */
+  rv_u32 version;
+  rv_u32 sizes[6]; /* layout check: mach_snap, rv, and each device */
+  rv_u32 harts, timebase, now, uart_at[2], irq[MACH_HARTS];
+  rv_u32 ram_size;
+  rv_u32 pages; /* ram pages in a checkpoint */
+} mach_snap;
+
+/* fill in the parts of a snapshot header that must match to restore it */
+void mach_snaphdr(mach_snap *s) {
+  memset(s, 0, sizeof(*s));
+  memcpy(s->magic, "rvsnap", 7);
+  s->version = MACH_SNAP_VERSION;
+  s->sizes[0] = sizeof(mach_snap), s->sizes[1] = sizeof(rv);
+  s->sizes[2] = sizeof(rv_plic), s->sizes[3] = sizeof(rv_clint);
+  s->sizes[4] = sizeof(rv_uart), s->sizes[5] = sizeof(rv_sched);
+}
+
+/* offset of ram in a snapshot of `harts` harts */
+long mach_snapram(rv_u32 harts) {
+  unsigned long end = sizeof(mach_snap) + harts * sizeof(rv) +
+                      sizeof(rv_plic) + sizeof(rv_clint) +
+                      2 * sizeof(rv_uart) + sizeof(rv_sched);
+  return (long)((end + MACH_SNAP_ALIGN - 1) & ~(MACH_SNAP_ALIGN - 1));
+}
+
+/* write a snapshot or checkpoint header, the harts and the devices */
+void mach_snapput(mach *m, FILE *f, rv_u32 pages) {
+  mach_snap s;
+  rv_u32 h;
+  mach_snaphdr(&s);
+  s.harts = m->harts, s.timebase = m->timebase, s.now = m->now;
+  memcpy(s.uart_at, m->uart_at, sizeof(s.uart_at));
+  memcpy(s.irq, m->irq, sizeof(s.irq));
+  s.ram_size = m->ram_size, s.pages = pages;
+  fwrite(&s, sizeof(s), 1, f);
+  for (h = 0; h < m->harts; h++)
+    fwrite(m->hart[h].cpu, sizeof(rv), 1, f);
+  fwrite(&m->plic0, sizeof(rv_plic), 1, f);
+  fwrite(&m->clint0, sizeof(rv_clint), 1, f);
+  fwrite(&m->uart0, sizeof(rv_uart), 1, f);
+  fwrite(&m->uart1, sizeof(rv_uart), 1, f);
+  fwrite(&m->sched, sizeof(rv_sched), 1, f);
+}
+
+/* read what mach_snapput wrote, allocating the harts on the first read, and
+ * return the number of pages that follow, or -1 if it does not match */
+long mach_snapget(mach *m, FILE *f) {
+  mach_snap s, want;
+  rv_u32 h, ok;
+  mach_snaphdr(&want);
+  ok = fread(&s, sizeof(s), 1, f) == 1 &&
+       !memcmp(&s, &want, (size_t)((char *)&want.harts - (char *)&want)) &&
+       s.harts >= 1 && s.harts <= MACH_HARTS &&
+       (!m->harts || s.harts == m->harts) &&
+       (!m->ram_size || s.ram_size == m->ram_size);
+  for (h = 0; ok && h < s.harts; h++)
+    ok = (m->hart[h].cpu || (m->hart[h].cpu = malloc(sizeof(rv)))) &&
+         fread(m->hart[h].cpu, sizeof(rv), 1, f) == 1;
+  if (!ok || fread(&m->plic0, sizeof(rv_plic), 1, f) != 1 ||
+      fread(&m->clint0, sizeof(rv_clint), 1, f) != 1 ||
+      fread(&m->uart0, sizeof(rv_uart), 1, f) != 1 ||
+      fread(&m->uart1, sizeof(rv_uart), 1, f) != 1 ||
+      fread(&m->sched, sizeof(rv_sched), 1, f) != 1)
+    return -1;
+  m->harts = s.harts, m->timebase = s.timebase, m->now = s.now;
+  m->ram_size = s.ram_size;
+  memcpy(m->uart_at, s.uart_at, sizeof(s.uart_at));
+  memcpy(m->irq, s.irq, sizeof(s.irq));
+  return (long)s.pages;
+}
+
+/* returns 1 if any hart stored to ram page `pg` since the last call, clearing
+ * every hart's mark */
+rv_u32 mach_dirty(mach *m, rv_u32 pg) {
+  rv_u32 h, dirty = 0;
+  for (h = 0; h < m->harts; h++)
+    dirty |= rv_dirty(m->hart[h].cpu, MACH_RAM_BASE + pg * 4096);
+  return dirty;
+}
+
+/* save the whole machine, which must be stopped. the file is replaced
+ * atomically, as a restored machine may still be mapping it. */
+void mach_save(mach *m, const char *path) {
+  char *tmp = malloc(strlen(path) + 5);
+  FILE *f;
+  unsigned long pg, x, ok = 1;
+  sprintf(tmp, "%s.new", path);
+  if (!(f = fopen(tmp, "wb"))) {
+    printf("unable to save snapshot %s\n", tmp);
+    exit(EXIT_FAILURE);
+  }
+  mach_snapput(m, f, 0);
+  for (pg = 0; pg < m->ram_size && ok; pg += 4096) {
+    mach_dirty(m, (rv_u32)(pg / 4096)); /* checkpoints start from here */
+    for (x = 0; x < 4096 && !m->ram[pg + x]; x++)
+      ;
+    if (x < 4096 || pg + 4096 == m->ram_size) /* leave holes for zeroes */
+      ok = !fseek(f, mach_snapram(m->harts) + (long)pg, SEEK_SET) &&
+           fwrite(m->ram + pg, 1, 4096, f) == 4096;
+  }
+  if (fclose(f) || !ok || rename(tmp, path)) {
+    printf("unable to write snapshot %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  free(tmp);
+}
+
+/* append a checkpoint of the pages stored to since the last save or
+ * checkpoint to the snapshot at `path`. with more ram than the dirty bitmap
+ * tracks, pages alias a bit, so a set bit writes every page that shares it. */
+void mach_checkpoint(mach *m, const char *path) {
+  rv_u32 *list = malloc(m->ram_size / 4096 * sizeof(rv_u32)), n = 0, pg, x;
+  rv_u8 *dirty = calloc(RV_DIRTY_PAGES, 1); /* each bit, read once */
+  FILE *f = fopen(path, "r+b");
+  unsigned long ok = f && !fseek(f, 0, SEEK_END);
+  for (pg = 0; pg < m->ram_size / 4096 && pg < RV_DIRTY_PAGES; pg++)
+    dirty[pg] = (rv_u8)mach_dirty(m, pg);
+  for (pg = 0; pg < m->ram_size / 4096; pg++)
+    if (dirty[pg & (RV_DIRTY_PAGES - 1)])
+      list[n++] = pg;
+  free(dirty);
+  if (ok) {
+    mach_snapput(m, f, n);
+    ok = fwrite(list, sizeof(rv_u32), n, f) == n;
+  }
+  for (x = 0; ok && x < n; x++)
+    ok = fwrite(m->ram + list[x] * 4096, 1, 4096, f) == 4096;
+  if (!f || fclose(f) || !ok) {
+    printf("unable to write checkpoint to %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  free(list);
+}
+
+/* restore a machine saved by mach_save, then apply its checkpoints. ram is
+ * mapped copy-on-write from the file, so restoring is fast and clean pages
+ * are shared between machines. host pointers are left for the caller to
+ * attach. */
+void mach_restore(mach *m, const char *path) {
+  FILE *f = fopen(path, "rb");
+  long pages, end;
+  rv_u32 h, pg;
+  if (!f) {
+    printf("unable to load snapshot %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  m->harts = 0, m->ram_size = 0; /* taken from the snapshot */
+  if (mach_snapget(m, f) < 0 || fseek(f, 0, SEEK_END) ||
+      (end = ftell(f)) < mach_snapram(m->harts) + (long)m->ram_size ||
+      (m->ram = mmap(NULL, m->ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fileno(f), mach_snapram(m->harts))) == MAP_FAILED)
+    end = -1;
+  fseek(f, mach_snapram(m->harts) + (long)m->ram_size, SEEK_SET);
+  while (end >= 0 && ftell(f) < end) { /* apply each checkpoint in turn */
+    rv_u32 *list = NULL;
+    if ((pages = mach_snapget(m, f)) < 0 ||
+        !(list = malloc((size_t)pages * sizeof(rv_u32) + 1)) ||
+        fread(list, sizeof(rv_u32), (size_t)pages, f) != (size_t)pages)
+      end = -1;
+    for (pg = 0; end >= 0 && pg < (rv_u32)pages; pg++)
+      if (list[pg] >= m->ram_size / 4096 ||
+          fread(m->ram + list[pg] * 4096, 1, 4096, f) != 4096)
+        end = -1;
+    free(list);
+  }
+  if (end < 0) {
+    printf("snapshot %s is damaged or from another mach\n", path);
+    exit(EXIT_FAILURE);
+  }
+  fclose(f);
+  for (h = 0; h < m->harts; h++)
+    rv_reattach(m->hart[h].cpu, m->hart + h, &mach_bus);
+}
+
+/* map zero-filled ram, aligned for host huge pages. the host only backs the
+ * pages the guest touches. */
+rv_u8 *mach_ram(unsigned long size) {
+  rv_u8 *ram = mmap(NULL, size + MACH_HUGE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ram == MAP_FAILED) {
+    printf("unable to map %lu bytes of ram\n", size);
+    exit(EXIT_FAILURE);
+  }
+  ram += (MACH_HUGE - ((unsigned long)ram & (MACH_HUGE - 1))) & (MACH_HUGE - 1);
+#ifdef MADV_HUGEPAGE
+  madvise(ram, size, MADV_HUGEPAGE);
+#endif
+  return ram;
+}
+
+/* big-endian word of a flattened device tree */
+#define mach_fdt(p)                                                            \
+  ((rv_u32)(p)[0] << 24 | (rv_u32)(p)[1] << 16 | (rv_u32)(p)[2] << 8 | (p)[3])
+
+/* set the size in the reg property of the device tree's memory node, assuming
+ * one address cell and one size cell, or two of each */
+rv_res mach_fdtmem(rv_u8 *dtb, rv_u32 size) {
+  rv_u8 *p = dtb + mach_fdt(dtb + 8), *str = dtb + mach_fdt(dtb + 12);
+  rv_u8 *end = dtb + mach_fdt(dtb + 4);
+  rv_u32 depth = 0, mem = 0, tok, len;
+  if (mach_fdt(dtb) != 0xD00DFEED || mach_fdt(dtb + 4) > MACH_DTB_MAX)
+    return RV_BAD;
+  while (p < end && (tok = mach_fdt(p)) != 9 /* FDT_END */) {
+    p += 4;
+    if (tok == 1) { /* FDT_BEGIN_NODE */
+      len = (rv_u32)strlen((char *)p) + 1;
+      mem = ++depth == 2 && (!strcmp((char *)p, "memory") ||
+                             !strncmp((char *)p, "memory@", 7));
+      p += (len + 3) & ~3U;
+    } else if (tok == 2) { /* FDT_END_NODE */
+      depth--, mem = 0;
+    } else if (tok == 3) { /* FDT_PROP */
+      len = mach_fdt(p);
+      if (mem && !strcmp((char *)str + mach_fdt(p + 4), "reg") &&
+          (len == 8 || len == 16)) {
+        memset(p + 8 + len / 2, 0, len / 2);
+        p[4 + len] = (rv_u8)(size >> 24), p[5 + len] = (rv_u8)(size >> 16);
+        p[6 + len] = (rv_u8)(size >> 8), p[7 + len] = (rv_u8)size;
+        return RV_OK;
+      }
+      p += 8 + ((len + 3) & ~3U);
+    } else if (tok != 4) { /* FDT_NOP */
+      return RV_BAD;
+    }
+  }
+  return RV_BAD;
+}
+
+/* serve forked instances on a unix socket: each connection gets a child that
+ * carries on from the machine's current state, sharing its ram copy-on-write,
+ * with uart0 over the connection. returns in each child. */
+void mach_serve(mach *m, const char *path) {
+  struct sockaddr_un addr;
+  int srv = socket(AF_UNIX, SOCK_STREAM, 0), fd;
+  pid_t pid;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  if (srv < 0 || bind(srv, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(srv, 16)) {
+    printf("unable to serve on %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  signal(SIGCHLD, SIG_IGN); /* don't leave zombies */
+  for (;;) {
+    if ((fd = accept(srv, NULL, NULL)) < 0)
+      continue;
+    if (!(pid = fork())) {
+      close(srv);
+      signal(SIGCHLD, SIG_DFL);
+      signal(SIGPIPE, SIG_IGN); /* see a closed connection in mach_fdio */
+      m->in = m->out = fd;
+      m->ninst = 0, m->done = 0;
+      return;
+    }
+    close(fd);
+  }
+}
+
+/* harts picked by an sbi hart mask and mask base, or all of them if the base
+ * is -1 */
+rv_u32 mach_sbiharts(mach *m, rv_u32 mask, rv_u32 base) {
+  rv_u32 all = (1U << m->harts) - 1;
+  if (base == 0xFFFFFFFF)
+    return all;
+  return base < m->harts ? mask << base & all : 0;
+}
+
+/* send remote fences to `harts` and wait until they are carried out, as the
+ * caller may rely on stale translations being gone when the call returns */
+void mach_sbifence(mach *m, rv_u32 h, rv_u32 harts) {
+  rv_u32 t, wait = 1;
+  for (t = 0; t < m->harts; t++)
+    m->fence[t] |= harts >> t & 1;
+  while (wait && !m->done) {
+    mach_hartirq(m, h); /* ours, and any a waiting hart sent us */
+    for (t = 0, wait = 0; t < m->harts; t++)
+      wait |= harts >> t & m->fence[t];
+    if (wait)
+      mach_unlock(m), sched_yield(), mach_lock(m);
+  }
+}
+
+/* service an sbi call that hart `h` made from s-mode, with the device lock
+ * held: the base, TIME, IPI and RFENCE extensions, and the legacy set_timer,
+ * console, clear_ipi and shutdown calls. the others are not supported, hart
+ * state management included, so linux must boot its harts by spinwait. */
+void mach_sbi(mach *m, rv_u32 h) {
+  rv *cpu = m->hart[h].cpu;
+  rv_u32 *a = cpu->r + 10 /* a0 */, eid = a[7], fid = a[6], err = 0, val = 0;
+  rv_u8 ch;
+  if (eid == 0x00 || (eid == MACH_SBI_TIME && fid == 0)) { /*Q set_timer */
+    if (cpu->csr.menvcfgh & MACH_STCE) /* rv_run compares it */
+      cpu->csr.stimecmp = a[0], cpu->csr.stimecmph = a[1];
+    else
+      m->clint0.mtimecmp[h] = a[0], m->clint0.mtimecmph[h] = a[1];
+    mach_irq(m);
+  } else if (eid == 0x01) { /*Q console_putchar */
+    ch = (rv_u8)a[0];
+    m->uart0.cb(m->uart0.user, &ch, 1);
+  } else if (eid == 0x02) { /*Q console_getchar */
+    err = m->uart0.cb(m->uart0.user, &ch, 0) == RV_OK ? ch : 0xFFFFFFFF;
+  } else if (eid == 0x03) { /*Q clear_ipi */
+    cpu->csr.mip &= ~(rv_u32)MACH_SSIP;
+  } else if (eid == 0x08) { /*Q shutdown */
+    m->done = m->halt = 1;
+  } else if (eid == MACH_SBI_BASE && fid <= 6) {
+    if (fid == 0) /*Q get_spec_version: 1.0 */
+      val = 0x01000000;
+    else if (fid == 1) /*Q get_impl_id */
+      val = MACH_SBI_IMPL;
+    else if (fid == 2) /*Q get_impl_version */
+      val = 1;
+    else if (fid == 3) /*Q probe_extension */
+      val = a[0] <= 0x03 || a[0] == 0x08 || a[0] == MACH_SBI_BASE ||
+            a[0] == MACH_SBI_TIME || a[0] == MACH_SBI_IPI ||
+            a[0] == MACH_SBI_RFNC;
+    else /*Q get_mvendorid, get_marchid, get_mimpid */
+      val = fid == 4 ? cpu->csr.mvendorid
+                     : (fid == 5 ? cpu->csr.marchid : cpu->csr.mimpid);
+  } else if (eid == MACH_SBI_IPI && fid == 0) { /*Q send_ipi */
+    rv_u32 harts = mach_sbiharts(m, a[0], a[1]), t;
+    for (t = 0; t < m->harts; t++)
+      m->clint0.mswi[t] |= harts >> t & 1;
+  } else if (eid == MACH_SBI_RFNC && fid <= 2) { /*Q remote_fence_i, */
+    mach_sbifence(m, h, mach_sbiharts(m, a[0], a[1])); /*Q remote_sfence_* */
+  } else {
+    err = MACH_SBI_ENOTSUP;
+  }
+  a[0] = err; /* legacy calls return only this */
+  if (eid >= MACH_SBI_BASE)
+    a[1] = val;
+  mach_hartirq(m, h);
+}
+
+#ifdef RV_STATS
+volatile sig_atomic_t mach_dump; /* set by SIGUSR1, see mach_stats */
+
+void mach_sigusr1(int sig) {
+  (void)sig;
+  mach_dump = 1;
+}
+
+#define mach_stat(f) /* summed statistic f */                                \
+  (sum + offsetof(rv_stats, f) / sizeof(rv_u32))
+
+/* print the statistics of all harts summed, then each device's accesses */
+void mach_stats(mach *m, FILE *f) {
+  static const char *const ops[32] = {
+      "load", 0,    0,     "misc-mem", "op-imm", "auipc", 0, 0,
+      "store", 0,   0,     "amo",      "op",     "lui",   0, 0,
+      0,      0,    0,     0,          0,        0,       0, 0,
+      "branch", "jalr", 0, "jal",      "system", 0,       0, 0};
+  static const char *const devs[] = {/* in the order main maps them */
+                                     "unmapped", "plic0", "clint0", "uart0",
+                                     "uart1"};
+  unsigned long sum[sizeof(rv_stats) / sizeof(rv_u32)] = {0};
+  rv_u32 h, x;
+  for (h = 0; h < m->harts; h++)
+    for (x = 0; x < sizeof(sum) / sizeof(*sum); x++)
+      sum[x] += ((rv_u32 *)&m->hart[h].cpu->stats)[x];
+  fprintf(f, "retired:");
+  for (x = 0; x < 32; x++)
+    if (mach_stat(op)[x])
+      fprintf(f, " %s %lu", ops[x] ? ops[x] : "?", mach_stat(op)[x]);
+  fprintf(f, ", %lu compressed\nexceptions:", *mach_stat(compressed));
+  for (x = 0; x < 16; x++)
+    if (mach_stat(exc)[x])
+      fprintf(f, " %lu (cause %lu)", mach_stat(exc)[x], (unsigned long)x);
+  fprintf(f, "\ninterrupts:");
+  for (x = 0; x < 16; x++)
+    if (mach_stat(irq)[x])
+      fprintf(f, " %lu (cause %lu)", mach_stat(irq)[x], (unsigned long)x);
+  fprintf(f, "\ni-tlb: %lu hits, %lu misses\n", mach_stat(tlb_hits)[1],
+          mach_stat(tlb_misses)[1]);
+  fprintf(f, "d-tlb: %lu hits, %lu misses\n", mach_stat(tlb_hits)[0],
+          mach_stat(tlb_misses)[0]);
+  fprintf(f, "walks: %lu ptes read\n", *mach_stat(ptes));
+  fprintf(f, "bus: %lu callbacks,", *mach_stat(bus));
+  for (x = 0; x < m->bus.ndev && x < sizeof(devs) / sizeof(*devs); x++)
+    fprintf(f, " %s %lu", devs[x], (unsigned long)m->bus.dev[x].hits);
+  fprintf(f, "\nmisaligned: %lu, %lu across pages\n",
+          *mach_stat(misaligned), *mach_stat(split));
+}
+#endif
+
+#ifdef RV_TRACE
+/* move trace records from every hart's ring to the trace file, napping while
+ * they are all empty, until tracing stops and the rings are drained */
+void *mach_drain(void *arg) {
+  mach *m = (mach *)arg;
+  struct timespec nap = {0, 1000000};
+  rv_u32 h, moved;
+  int last;
+  do {
+    last = !__atomic_load_n(&m->tracing, __ATOMIC_ACQUIRE);
+    for (h = 0, moved = 0; h < m->harts; h++)
+      moved += rv_trace_drain(&m->trace, h, &m->hart[h].cpu->trace);
+    m->traced += moved;
+    if (!moved && !last)
+      nanosleep(&nap, NULL);
+  } while (!last || moved);
+  return NULL;
+}
+#endif
+
+/* run a hart in batches, then pick up its interrupt lines under the device
+ * lock. hart 0 runs up to the next device event (at most MACH_SYNC
+ * instructions with >1 hart) and then runs the events that are due, idling
+ * in wfi if it is the only hart; other harts run MACH_SYNC instructions at a
+ * time and read hart 0's time. */
+void *mach_run(void *arg) {
+  mach_hart *hart = (mach_hart *)arg;
+  mach *m = hart->m;
+  rv *cpu = hart->cpu;
+  rv_u32 h = cpu->csr.mhartid, budget = h ? MACH_SYNC : 1, ran, when, err;
+  int done = 0, sampled = 0;
+  rv_prof_stack stack;
+  while (!done) {
+    err = rv_run(cpu, m->period && hart->left < budget ? hart->left : budget,
+                 &ran);
+    if (m->period && ran >= hart->left) /* unwind before taking the lock */
+      hart->left = m->period, rv_prof_unwind(&stack, cpu), sampled = 1;
+    else if (m->period)
+      hart->left -= ran;
+#ifdef RV_TRACE
+    if (!ran && cpu->trace.rec)
+      sched_yield(); /* the ring is full, let mach_drain empty it */
+#endif
+    mach_lock(m);
+    if (sampled)
+      rv_prof_add(&m->prof, &stack), sampled = 0;
+    if (err == RV_TRAP_ECALL)
+      mach_sbi(m, h);
+    if (h == 0) { /* hart 0 keeps time and runs the device events */
+      m->now += ran;
+      mach_events(m);
+      mach_hartirq(m, 0);
+      if (err == RV_TRAP_WFI && m->harts == 1 &&
+          !(cpu->csr.mip & cpu->csr.mie))
+        mach_idle(m);
+      rv_sched_next(&m->sched, &when);
+      budget = when - m->now;
+      if (m->harts > 1 && budget > MACH_SYNC)
+        budget = MACH_SYNC;
+      if ((m->ran += ran) > m->ninst && m->ninst)
+        m->done = 1;
+      else if (m->ninst && m->ninst + 1 - m->ran < budget)
+        budget = (rv_u32)(m->ninst + 1 - m->ran);
+#ifdef RV_STATS
+      if (mach_dump)
+        mach_dump = 0, mach_stats(m, stderr);
+#endif
+    } else {
+      cpu->csr.mtime = m->hart[0].cpu->csr.mtime;
+      cpu->csr.mtimeh = m->hart[0].cpu->csr.mtimeh;
+    }
+    mach_hartirq(m, h);
+    done = m->done;
+    mach_unlock(m);
+  }
+  return NULL;
+}
+
+/* instructions run by all harts so far, from their cycle counters */
+double mach_retired(mach *m) {
+  double n = 0;
+  rv_u32 h;
+  for (h = 0; h < m->harts; h++)
+    n += m->hart[h].cpu->csr.cycleh * 4294967296.0 + m->hart[h].cpu->csr.cycle;
+  return n;
+}
+
+/* run every hart until the machine stops, one thread per hart; hart 0 runs on
+ * this one */
+void mach_harts(mach *m) {
+  pthread_t threads[MACH_HARTS];
+  rv_u32 h;
+  m->epoch = m->hart[0].cpu->csr.mtimeh * 4294967296.0 +
+             m->hart[0].cpu->csr.mtime; /* resume the clock from here */
+  clock_gettime(CLOCK_MONOTONIC, &m->start);
+  for (h = 1; h < m->harts; h++)
+    pthread_create(threads + h, NULL, &mach_run, m->hart + h);
+  mach_run(m->hart);
+  for (h = 1; h < m->harts; h++)
+    pthread_join(threads[h], NULL);
+}
+
 /* dumb bootrom */
 void load(const char *path, rv_u8 *buf, rv_u32 max_size) {
   FILE *f = fopen(path, "rb");
@@ -79,65 +814,238 @@ void load(const char *path, rv_u8 *buf, rv_u32 max_size) {
   fclose(f);
 }
 
-int main(int argc, const char *const *argv) {
-  rv cpu;
+int main(int argc, char **argv) {
   mach m;
-  rv_u32 rtc_period = 0;
-  size_t ninst = 0, ctr = 0;
+  rv_u32 hot = 0, harts = 1, timebase = MACH_TIMEBASE, mib = MACH_RAM_SIZE, h;
+  int opt, det = 0, sbi = 0, saved = 0, headless = 0;
+  size_t every = 0, total;
+  const char *snap_in = NULL, *snap_out = NULL, *serve = NULL;
+  const char *prof_out = NULL, *elf = NULL, *marker = NULL;
+  struct timespec t0, t1;
+  double inst0, inst, sec;
+  rv_u32 period = MACH_PROF_PERIOD;
+  FILE *f, *rep; /* reports go to stderr, apart from a headless console */
+#ifdef RV_TRACE
+  const char *trace = NULL;
+  pthread_t drain;
+  int raw = 0;
+#endif
 
-  if (argc < 3) {
+  while ((opt = getopt(argc, argv, "bc:de:f:Hi:j:m:n:p:r:s:t:w:x:X:")) != -1) {
+    if (opt == 'b') { /* boot a kernel in s-mode, the sbi in the host */
+      sbi = 1;
+    } else if (opt == 'c') { /* checkpoint interval */
+      every = (size_t)atol(optarg);
+    } else if (opt == 'd') { /* deterministic time */
+      det = 1;
+    } else if (opt == 'e') { /* name profiled frames from this elf */
+      elf = optarg;
+    } else if (opt == 'f') { /* fork server */
+      serve = optarg;
+    } else if (opt == 'H') { /* uart0 on stdin and stdout, without curses */
+      headless = 1;
+    } else if (opt == 'i' && atol(optarg) >= 1) { /* profile sample period */
+      period = (rv_u32)atol(optarg);
+    } else if (opt == 'j') { /* hot block tier threshold */
+      hot = (rv_u32)atol(optarg);
+    } else if (opt == 'm' && atol(optarg) >= 64 &&
+               atol(optarg) <= (long)MACH_RAM_MAX) { /* MiB of ram */
+      mib = (rv_u32)atol(optarg);
+    } else if (opt == 'n' && atol(optarg) >= 1 && atol(optarg) <= MACH_HARTS) {
+      harts = (rv_u32)atol(optarg);
+    } else if (opt == 'p') { /* profile to this file */
+      prof_out = optarg;
+    } else if (opt == 'r') { /* restore instead of booting */
+      snap_in = optarg;
+    } else if (opt == 's') { /* save once stopped */
+      snap_out = optarg;
+    } else if (opt == 't' && atol(optarg) >= 1) { /* must match the dtb */
+      timebase = (rv_u32)atol(optarg);
+    } else if (opt == 'w' && *optarg) { /* headless until uart0 writes this */
+      marker = optarg, headless = 1;
+#ifdef RV_TRACE
+    } else if (opt == 'x' || opt == 'X') { /* trace, raw records if -X */
+      trace = optarg, raw = opt == 'X';
+#endif
+    } else {
+      printf("usage: mach [-b] [-c count] [-d] [-e elf] [-f socket] [-H] "
+             "[-i count] [-j count]\n"
+             "            [-m MiB] [-n harts] [-p profile] [-s snapshot] "
+             "[-t timebase] [-w marker]\n"
+             "            [-x trace | -X trace] "
+             "(firmware dtb | -r snapshot) [instructions]\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  argc -= optind, argv += optind;
+  rep = headless ? stderr : stdout;
+  if (!snap_in && argc < 2) {
     printf("expected a firmware image and a binary device tree\n");
     exit(EXIT_FAILURE);
   }
 
   /* initialize machine */
   memset(&m, 0, sizeof(m));
-  m.ram = malloc(MACH_RAM_SIZE);
-  m.cpu = &cpu;
-  memset(m.ram, 0, MACH_RAM_SIZE);
+  m.harts = harts;
+  m.ram_size = mib << 20;
+  m.timebase = timebase;
+  m.det = det;
+  pthread_mutex_init(&m.lock, NULL);
 
-  /* peripheral setup */
-  rv_init(&cpu, &m, &mach_bus);
-  rv_plic_init(&m.plic0);
-  rv_clint_init(&m.clint0, &cpu);
-  rv_uart_init(&m.uart0, NULL, &uart0_io);
-  rv_uart_init(&m.uart1, &m, &uart1_io);
+  if (snap_in) { /* harts, timebase, devices and ram come from the snapshot */
+    mach_restore(&m, snap_in);
+  } else {
+    m.ram = mach_ram(m.ram_size);
+    /* the bootloader and linux expect the following on every hart: */
+    for (h = 0; h < harts; h++) {
+      rv *cpu = m.hart[h].cpu = malloc(sizeof(rv));
+      rv_init(cpu, m.hart + h, &mach_bus);
+      cpu->csr.mhartid = h;
+      cpu->r[10] /* a0 */ = h;                               /* hartid */
+      cpu->r[11] /* a1 */ = MACH_RAM_BASE + MACH_DTB_OFFSET; /* dtb ptr */
+      if (sbi) { /* and what m-mode firmware would have set up: */
+        cpu->priv = RV_PSUPER;
+        cpu->csr.medeleg = 0xB1FF;     /* exceptions, bar s/m-mode ecalls */
+        cpu->csr.mideleg = 0x222;      /* s-mode interrupts */
+        cpu->csr.menvcfgh = MACH_STCE; /* stimecmp (sstc) */
+        cpu->ecall = 1 << RV_PSUPER;   /* sbi calls, see mach_sbi */
+      }
+    }
+    rv_plic_init(&m.plic0);
+    rv_clint_init(&m.clint0, m.hart[0].cpu);
+    rv_uart_init(&m.uart0, NULL, NULL);
+    rv_uart_init(&m.uart1, NULL, NULL);
+    rv_sched_init(&m.sched);
+    rv_sched_set(&m.sched, MACH_EV_RTC, MACH_RTC_PERIOD);
+    /* load kernel and dtb */
+    load(argv[0], m.ram, m.ram_size);
+    load(argv[1], m.ram + MACH_DTB_OFFSET, m.ram_size - MACH_DTB_OFFSET);
+    if (mach_fdtmem(m.ram + MACH_DTB_OFFSET, m.ram_size))
+      fprintf(rep, "warning: no memory node to resize in %s\n", argv[1]);
+    argc -= 2, argv += 2;
+  }
+
+  /* host state, which snapshots leave out */
+  for (h = 0; h < m.harts; h++) {
+    rv *cpu = m.hart[h].cpu;
+    m.hart[h].m = &m;
+    rv_map_ram(cpu, MACH_RAM_BASE, m.ram_size, m.ram); /* bypass mach_bus */
+    cpu->hot = hot;
+    m.hart[h].left = period;
+#ifdef RV_TRACE
+    memset(&cpu->trace, 0, sizeof(cpu->trace)); /* not tracing, yet */
+#endif
+  }
+  rv_prof_init(&m.prof);
+  m.period = prof_out ? period : 0;
+  if (elf && rv_prof_elf(&m.prof, elf))
+    fprintf(rep, "warning: no symbols in %s\n", elf);
+  m.sbi = m.hart[0].cpu->ecall != 0; /* snapshots keep the boot mode */
+  m.clint0.cpu = m.hart[0].cpu;
+  m.uart0.cb = serve || headless ? &mach_fdio : &uart0_io, m.uart0.user = &m;
+  m.uart1.cb = &uart1_io, m.uart1.user = &m;
+  m.in = serve ? -1 : STDIN_FILENO, m.out = STDOUT_FILENO;
+  m.headless = headless, m.marker = marker;
+  if (marker)
+    m.seen = calloc(strlen(marker), 1);
+  rv_mmio_init(&m.bus);
+  rv_mmio_map(&m.bus, MACH_PLIC0_BASE, RV_PLIC_SIZE, &rv_plic_bus, &m.plic0);
+  rv_mmio_map(&m.bus, MACH_CLINT0_BASE, RV_CLINT_SIZE, &rv_clint_bus,
+              &m.clint0);
+  rv_mmio_map(&m.bus, MACH_UART0_BASE, RV_UART_SIZE, &rv_uart_bus, &m.uart0);
+  rv_mmio_map(&m.bus, MACH_UART1_BASE, RV_UART_SIZE, &rv_uart_bus, &m.uart1);
 
-  /* load kernel and dtb */
-  load(argv[1], m.ram, MACH_RAM_SIZE);
-  load(argv[2], m.ram + MACH_DTB_OFFSET, MACH_RAM_SIZE - MACH_DTB_OFFSET);
+  mach_uart(&m, 0), mach_uart(&m, 1);
+  mach_irq(&m);
+#ifdef RV_STATS
+  signal(SIGUSR1, mach_sigusr1); /* print statistics */
+#endif
 
   /* try and figure out how many instructions to run */
-  if (argc == 4) {
-    ninst = (size_t)atol(argv[3]);
+  if (argc == 1) {
+    m.ninst = (size_t)atol(argv[0]);
+  }
+
+  if (serve) { /* warm up if asked to, then run each instance in a child */
+    if (m.ninst)
+      mach_harts(&m);
+    mach_serve(&m, serve);
+    mach_harts(&m);
+    return EXIT_SUCCESS;
   }
 
-  /* ncurses setup */
-  initscr();              /* initialize screen */
-  cbreak();               /* don't buffer input chars */
-  noecho();               /* don't echo input chars */
-  scrollok(stdscr, TRUE); /* allow the screen to autoscroll */
-  nodelay(stdscr, TRUE);  /* enable nonblocking input */
+  if (headless) {
+    signal(SIGPIPE, SIG_IGN); /* see a closed stdout in mach_fdio */
+    fflush(stdout);           /* ahead of the console's writes */
+  } else {                    /* ncurses setup */
+    initscr();                /* initialize screen */
+    cbreak();                 /* don't buffer input chars */
+    noecho();                 /* don't echo input chars */
+    scrollok(stdscr, TRUE);   /* allow the screen to autoscroll */
+    nodelay(stdscr, TRUE);    /* enable nonblocking input */
+  }
 
-  /* the bootloader and linux expect the following: */
-  cpu.r[10] /* a0 */ = 0;                               /* hartid */
-  cpu.r[11] /* a1 */ = MACH_RAM_BASE + MACH_DTB_OFFSET; /* dtb ptr */
-  do {
-    rv_u32 irq = 0;
-    if (!(rtc_period = (rtc_period + 1) & 0xFFF))
-      if (!++cpu.csr.mtime)
-        cpu.csr.mtimeh++;
-    rv_step(&cpu);
-    if (rv_uart_update(&m.uart0))
-      rv_plic_irq(&m.plic0, 1);
-    if (rv_uart_update(&m.uart1))
-      rv_plic_irq(&m.plic0, 2);
-    irq = RV_CSI * rv_clint_msi(&m.clint0, 0) |
-          RV_CTI * rv_clint_mti(&m.clint0, 0) |
-          RV_CEI * rv_plic_mei(&m.plic0, 0);
-    rv_irq(&cpu, irq);
-  } while (!ninst || ctr++ < ninst);
-
-  endwin();
-  return EXIT_SUCCESS;
+#ifdef RV_TRACE
+  if (trace && rv_trace_create(&m.trace, trace, !raw)) {
+    if (!headless)
+      endwin();
+    fprintf(rep, "unable to create trace %s\n", trace);
+    exit(EXIT_FAILURE);
+  }
+  for (h = 0; trace && h < m.harts; h++) {
+    rv *cpu = m.hart[h].cpu;
+    cpu->trace.rec = malloc(MACH_TRACE_RING * sizeof(rv_trace_rec));
+    cpu->trace.mask = MACH_TRACE_RING - 1;
+  }
+  if (trace)
+    m.tracing = 1, pthread_create(&drain, NULL, &mach_drain, &m);
+#endif
+
+  total = m.ninst;
+  clock_gettime(CLOCK_MONOTONIC, &t0), inst0 = mach_retired(&m);
+  do { /* run to each checkpoint, or straight to the end */
+    if (every)
+      m.ninst = total && total < m.ran + every ? total : m.ran + every;
+    m.done = 0;
+    mach_harts(&m);
+    if (snap_out && !m.det)
+      mach_clock(&m); /* save the time we stopped at */
+    if (snap_out && saved)
+      mach_checkpoint(&m, snap_out);
+    else if (snap_out)
+      mach_save(&m, snap_out), saved = 1;
+  } while (every && !m.halt && !m.found && (!total || m.ran <= total));
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  if (headless) {
+    sec = (double)(t1.tv_sec - t0.tv_sec) +
+          (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    inst = mach_retired(&m) - inst0;
+    fprintf(rep, "\nheadless: %.3f s, %.0f instructions, %.2f MIPS%s\n",
+            sec, inst, inst / sec / 1e6,
+            !marker ? "" : m.found ? ", marker found" : ", marker not found");
+  } else {
+    endwin();
+  }
+#ifdef RV_TRACE
+  if (trace) {
+    __atomic_store_n(&m.tracing, 0, __ATOMIC_RELEASE);
+    pthread_join(drain, NULL);
+    rv_trace_close(&m.trace);
+    fprintf(rep, "trace: %lu records\n", m.traced);
+  }
+#endif
+  fprintf(rep, "idle: %lu mtime ticks in wfi\n", m.idle);
+  if (prof_out && (f = fopen(prof_out, "w"))) {
+    rv_prof_write(&m.prof, f);
+    fclose(f);
+    fprintf(rep, "profile: %lu samples, %lu dropped\n",
+            (unsigned long)m.prof.samples, (unsigned long)m.prof.dropped);
+  } else if (prof_out) {
+    fprintf(rep, "unable to write profile %s\n", prof_out);
+  }
+#ifdef RV_STATS
+  mach_stats(&m, rep);
+#endif
+  return marker && !m.found ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -7,18 +7,18 @@ void rv_clint_init(rv_clint *clint, rv *cpu) {
   clint->cpu = cpu;
 }
 
-rv_res rv_clint_bus(rv_clint *clint, rv_u32 addr, rv_u8 *d, rv_u32 is_store,
+rv_res rv_clint_bus(void *user, rv_u32 addr, rv_u8 *d, rv_u32 is_store,
                     rv_u32 width) {
+  rv_clint *clint = (rv_clint *)user;
   rv_u32 *reg, data;
   rv_endcvt(d, (rv_u8 *)&data, 4, 0);
   if (width != 4)
     return RV_BAD;
-  if (addr == 0x0) /*R mswi */
-    reg = &clint->mswi;
-  else if (addr == 0x4000 + 0x0000) /*R mtimecmp */
-    reg = &clint->mtimecmp;
-  else if (addr == 0x4000 + 0x0000 + 4) /*R mtimecmph */
-    reg = &clint->mtimecmph;
+  if (addr < RV_CLINT_NHART * 4) /*R mswi */
+    reg = clint->mswi + (addr >> 2);
+  else if (addr >= 0x4000 && addr < 0x4000 + RV_CLINT_NHART * 8) /*R mtimecmp */
+    reg = (addr & 4 ? clint->mtimecmph : clint->mtimecmp) +
+          ((addr - 0x4000) >> 3); /*R mtimecmph */
   else if (addr == 0x4000 + 0x7FF8) /*R mtime */
     reg = &clint->cpu->csr.mtime;
   else if (addr == 0x4000 + 0x7FF8 + 4) /*R mtimeh */
@@ -34,13 +34,11 @@ rv_res rv_clint_bus(rv_clint *clint, rv_u32 addr, rv_u8 *d, rv_u32 is_store,
 }
 
 rv_u32 rv_clint_msi(rv_clint *clint, rv_u32 context) {
-  (void)context; /* unused for now, perhaps add multicore support later */
-  return clint->mswi & 1;
+  return clint->mswi[context] & 1;
 }
 
 rv_u32 rv_clint_mti(rv_clint *clint, rv_u32 context) {
-  (void)context;
-  return (clint->cpu->csr.mtimeh > clint->mtimecmph) ||
-         ((clint->cpu->csr.mtimeh == clint->mtimecmph) &&
-          (clint->cpu->csr.mtime >= clint->mtimecmp));
+  return (clint->cpu->csr.mtimeh > clint->mtimecmph[context]) ||
+         ((clint->cpu->csr.mtimeh == clint->mtimecmph[context]) &&
+          (clint->cpu->csr.mtime >= clint->mtimecmp[context]));
 }
@@ -6,24 +6,27 @@
 
 #include "rv.h"
 
+#define RV_CLINT_NHART 8 /* maximum number of harts */
+
 typedef struct rv_clint {
-  rv *cpu;
-  rv_u32 mswi, mtimecmp, mtimecmph;
+  rv *cpu; /* hart whose mtime is the machine's */
+  rv_u32 mswi[RV_CLINT_NHART], mtimecmp[RV_CLINT_NHART],
+      mtimecmph[RV_CLINT_NHART];
 } rv_clint;
 
-/* initialize the interruptor for a given cpu */
+/* initialize the interruptor, taking mtime from the given cpu */
 void rv_clint_init(rv_clint *clint, rv *cpu);
 
 #define RV_CLINT_SIZE /* size of memory map */ 0x10000
 
-/* perform a bus access on the interruptor */
-rv_res rv_clint_bus(rv_clint *clint, rv_u32 addr, rv_u8 *data, rv_u32 is_store,
+/* perform a bus access on the interruptor, `user` is the rv_clint */
+rv_res rv_clint_bus(void *user, rv_u32 addr, rv_u8 *data, rv_u32 is_store,
                     rv_u32 width);
 
-/* returns 1 if a machine software interrupt is occurring */
+/* returns 1 if a machine software interrupt is pending for hart `context` */
 rv_u32 rv_clint_msi(rv_clint *clint, rv_u32 context);
 
-/* returns 1 if a machine timer interrupt is occurring */
+/* returns 1 if a machine timer interrupt is pending for hart `context` */
 rv_u32 rv_clint_mti(rv_clint *clint, rv_u32 context);
 
 #endif /* RV_CLINT_H */
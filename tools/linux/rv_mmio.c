@@ -0,0 +1,67 @@
+#include "rv_mmio.h"
+
+#include <string.h>
+
+void rv_mmio_init(rv_mmio *mmio) {
+  memset(mmio, 0, sizeof(*mmio));
+  mmio->ndev = mmio->nleaf = 1; /* dev[0] and leaf[0] map nothing */
+}
+
+/* 1 if the pages [pg, end) are all unmapped */
+static rv_u32 rv_mmio_free(rv_mmio *mmio, rv_u32 pg, rv_u32 end) {
+  for (; pg < end; pg++)
+    if (mmio->leaf[mmio->root[pg >> 10]][pg & 1023])
+      return 0;
+  return 1;
+}
+
+/* map pages [pg, end) to device d, or just count the leaves needed if !set */
+static rv_u32 rv_mmio_fill(rv_mmio *mmio, rv_u32 pg, rv_u32 end, rv_u8 d,
+                           rv_u32 set) {
+  rv_u32 n, need = 0, whole = 0 /* leaf shared by whole regions */;
+  for (; pg < end; pg += n) {
+    n = 1024 - (pg & 1023); /* pages left in this 4MiB region */
+    n = n < end - pg ? n : end - pg;
+    if (n == 1024 && !whole) { /* whole regions share one leaf */
+      whole = set ? mmio->nleaf++ : 1, need++;
+      if (set)
+        memset(mmio->leaf[whole], d, 1024);
+    } else if (n < 1024 && !mmio->root[pg >> 10]) { /* partial region */
+      need++;
+      if (set)
+        mmio->root[pg >> 10] = (rv_u8)mmio->nleaf++;
+    }
+    if (set && n == 1024)
+      mmio->root[pg >> 10] = (rv_u8)whole;
+    else if (set)
+      memset(mmio->leaf[mmio->root[pg >> 10]] + (pg & 1023), d, n);
+  }
+  return need;
+}
+
+rv_res rv_mmio_map(rv_mmio *mmio, rv_u32 base, rv_u32 size, rv_bus_cb cb,
+                   void *user) {
+  rv_u32 pg = base >> 12, end = pg + (size >> 12) + !!(size & 0xFFF);
+  rv_u8 d = (rv_u8)mmio->ndev;
+  if ((base & 0xFFF) || !size || end > 0x100000 || d == RV_MMIO_DEVS ||
+      !rv_mmio_free(mmio, pg, end) ||
+      mmio->nleaf + rv_mmio_fill(mmio, pg, end, d, 0) > RV_MMIO_LEAVES)
+    return RV_BAD;
+  rv_mmio_fill(mmio, pg, end, d, 1);
+  mmio->dev[d].cb = cb, mmio->dev[d].user = user;
+  mmio->dev[d].base = base, mmio->dev[d].size = size, mmio->ndev++;
+  return RV_OK;
+}
+
+rv_res rv_mmio_bus(void *user, rv_u32 addr, rv_u8 *data, rv_u32 is_store,
+                   rv_u32 width) {
+  rv_mmio *mmio = (rv_mmio *)user;
+  rv_u8 *leaf = mmio->leaf[mmio->root[addr >> 22]];
+  rv_mmio_dev *dev = mmio->dev + leaf[addr >> 12 & 1023];
+#ifdef RV_STATS
+  dev->hits++;
+#endif
+  if (addr - dev->base >= dev->size)
+    return RV_BAD; /* unmapped, or past the end of the device */
+  return dev->cb(dev->user, addr - dev->base, data, is_store, width);
+}
@@ -0,0 +1,42 @@
+/* Memory-mapped device registry: routes bus accesses to devices through a
+ * two-level page table, so dispatch cost doesn't depend on the device count */
+
+#ifndef RV_MMIO_H
+#define RV_MMIO_H
+
+#include "rv.h"
+
+#define RV_MMIO_DEVS 16   /* maximum devices, including the unmapped device */
+#define RV_MMIO_LEAVES 16 /* second-level tables, each maps 4MiB */
+
+/* a device mapped at [base, base + size) */
+typedef struct rv_mmio_dev {
+  rv_bus_cb cb;
+  void *user;
+  rv_u32 base, size;
+#ifdef RV_STATS
+  rv_u32 hits; /* accesses routed here, including out-of-range ones */
+#endif
+} rv_mmio_dev;
+
+typedef struct rv_mmio {
+  rv_mmio_dev dev[RV_MMIO_DEVS]; /* dev[0] is the unmapped device */
+  rv_u32 ndev, nleaf;
+  rv_u8 root[1024];                   /* 4MiB region -> leaf, 0 if unmapped */
+  rv_u8 leaf[RV_MMIO_LEAVES][1024];   /* 4KiB page -> device */
+} rv_mmio;
+
+/* initialize the registry with nothing mapped */
+void rv_mmio_init(rv_mmio *mmio);
+
+/* map a device at `base`, which must be 4KiB-aligned. `cb` is called with
+ * `user` and the offset of the access from `base`. Devices can't share pages.
+ * Returns RV_BAD if the pages are taken or the registry is full. */
+rv_res rv_mmio_map(rv_mmio *mmio, rv_u32 base, rv_u32 size, rv_bus_cb cb,
+                   void *user);
+
+/* perform a bus access on the device at addr, `user` is the rv_mmio */
+rv_res rv_mmio_bus(void *user, rv_u32 addr, rv_u8 *data, rv_u32 is_store,
+                   rv_u32 width);
+
+#endif /* RV_MMIO_H */
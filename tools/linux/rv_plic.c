@@ -5,8 +5,9 @@
 
 void rv_plic_init(rv_plic *plic) { memset(plic, 0, sizeof(*plic)); }
 
-rv_res rv_plic_bus(rv_plic *plic, rv_u32 addr, rv_u8 *d, rv_u32 is_store,
+rv_res rv_plic_bus(void *user, rv_u32 addr, rv_u8 *d, rv_u32 is_store,
                    rv_u32 width) {
+  rv_plic *plic = (rv_plic *)user;
   rv_u32 *reg = NULL, wmask = 0 - 1U, data;
   rv_endcvt(d, (rv_u8 *)&data, 4, 0);
   if (addr >= RV_PLIC_SIZE || width != 4)
@@ -16,23 +17,23 @@ rv_res rv_plic_bus(rv_plic *plic, rv_u32 addr, rv_u8 *d, rv_u32 is_store,
   else if (addr >= 0x1000 &&
            addr < 0x1000 + RV_PLIC_NSRC / 8) /*R Interrupt Pending Bits */
     reg = plic->pending + ((addr - 0x1000) >> 2), wmask ^= addr == 0x1000;
-  else if (addr >= 0x2000 &&
-           addr < 0x2000 + RV_PLIC_NSRC / 8) /*R Interrupt Enable Bits */
-    reg = plic->enable + ((addr - 0x2000) >> 2), wmask ^= addr == 0x2000;
+  else if (addr >= 0x2000 && addr < 0x2000 + 0x80 * RV_PLIC_NCTX &&
+           (addr & 0x7F) < RV_PLIC_NSRC / 8) /*R Interrupt Enable Bits */
+    reg = plic->enable + ((addr - 0x2000) >> 7) * (RV_PLIC_NSRC / 32) +
+          ((addr & 0x7F) >> 2),
+    wmask ^= !(addr & 0x7F);
   else if (addr >> 12 >= 0x200 && (addr >> 12) < 0x200 + RV_PLIC_NCTX &&
            !(addr & 0xFFF)) /*R Priority Threshold */
     reg = plic->thresh + ((addr >> 12) - 0x200);
   else if (addr >> 12 >= 0x200 && (addr >> 12) < 0x200 + RV_PLIC_NCTX &&
            (addr & 0xFFF) == 4) /*R Interrupt Claim Register */ {
-    rv_u32 context = (addr >> 12) - 0x200, en_off = context * RV_PLIC_NSRC / 32;
+    rv_u32 context = (addr >> 12) - 0x200;
     reg = plic->claim + context;
-    if (!is_store && *reg < RV_PLIC_NSRC) {
-      if (plic->pending[*reg / 32] & (1U << *reg % 32))
-        plic->claiming[*reg / 32 + en_off] |=
-            1U << *reg % 32; /* set claiming bit */
+    if (!is_store && (rv_plic_mei(plic, context), *reg < RV_PLIC_NSRC)) {
+      if (plic->pending[*reg / 32] & (1U << *reg % 32)) /* not yet claimed */
+        plic->claiming[*reg / 32] |= 1U << *reg % 32; /* set claiming bit */
     } else if (is_store && data < RV_PLIC_NSRC) {
-      plic->claiming[data / 32 + en_off] &=
-          ~(1U << data % 32); /* unset claiming bit */
+      plic->claiming[data / 32] &= ~(1U << data % 32); /* unset claiming bit */
     }
   }
   if (reg && !is_store)
@@ -59,9 +60,9 @@ rv_u32 rv_plic_mei(rv_plic *plic, rv_u32 context) {
     if (!((plic->enable[en_off] & plic->pending[i]) | plic->claiming[i]))
       continue;
     for (j = 0; j < 32; j++) {
-      if ((plic->claiming[en_off] >> j) & 1U)
+      if ((plic->claiming[i] >> j) & 1U)
         plic->pending[i] &= ~(1U << j);
-      else if (((plic->enable[i] >> j) & 1U) &&
+      else if (((plic->enable[en_off] >> j) & 1U) &&
                ((plic->pending[i] >> j) & 1U) &&
                plic->priority[i * 32 + j] >= h &&
                plic->priority[i * 32 + j] >= plic->thresh[context])
@@ -7,7 +7,7 @@
 #include "rv.h"
 
 #define RV_PLIC_NSRC 32
-#define RV_PLIC_NCTX 1
+#define RV_PLIC_NCTX 8 /* contexts, one per hart */
 
 typedef struct rv_plic {
   rv_u32 priority[RV_PLIC_NSRC];
@@ -23,8 +23,8 @@ void rv_plic_init(rv_plic *plic);
 
 #define RV_PLIC_SIZE /* size of memory map */ 0x4000000
 
-/* perform a bus access on the plic */
-rv_res rv_plic_bus(rv_plic *plic, rv_u32 addr, rv_u8 *data, rv_u32 is_store,
+/* perform a bus access on the plic, `user` is the rv_plic */
+rv_res rv_plic_bus(void *user, rv_u32 addr, rv_u8 *data, rv_u32 is_store,
                    rv_u32 width);
 
 /* request an interrupt with the given interrupt source */
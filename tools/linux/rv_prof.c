@@ -0,0 +1,166 @@
+#include "rv_prof.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RV_PROF_SLOTS 1024 /* initial hash table slots */
+
+#define rv_prof_u16(p) ((rv_u32)(p)[0] | (rv_u32)(p)[1] << 8) /* ELF field */
+#define rv_prof_u32(p) (rv_prof_u16(p) | rv_prof_u16((p) + 2) << 16)
+
+void rv_prof_init(rv_prof *prof) { memset(prof, 0, sizeof(*prof)); }
+
+void rv_prof_unwind(rv_prof_stack *s, rv *cpu) {
+  rv_u32 fp /* frame pointer */ = cpu->r[8], ra, prev;
+  s->priv = cpu->priv, s->satp = cpu->priv == RV_PUSER ? cpu->csr.satp : 0;
+  s->count = 0, s->pc[0] = cpu->pc, s->depth = 1;
+  /* a frame's return address and its caller's frame pointer are just below
+   * its frame pointer */
+  while (s->depth < RV_PROF_DEPTH && fp && !rv_peek(cpu, fp - 4, &ra) &&
+         !rv_peek(cpu, fp - 8, &prev) && ra) {
+    s->pc[s->depth++] = ra;
+    if (prev <= fp)
+      break; /* stacks grow down, so callers' frames must be higher */
+    fp = prev;
+  }
+}
+
+static rv_u32 rv_prof_hash(const rv_prof_stack *s) {
+  rv_u32 h = 2166136261U ^ s->priv ^ s->satp, x; /* FNV-1a over words */
+  for (x = 0; x < s->depth; x++)
+    h = (h ^ s->pc[x]) * 16777619U;
+  return h;
+}
+
+static rv_u32 rv_prof_same(const rv_prof_stack *a, const rv_prof_stack *b) {
+  return a->priv == b->priv && a->satp == b->satp && a->depth == b->depth &&
+         !memcmp(a->pc, b->pc, a->depth * sizeof(*a->pc));
+}
+
+/* empty slot for stack s, or the slot already holding it */
+static rv_prof_stack *rv_prof_slot(rv_prof_stack *tab, rv_u32 size,
+                                   const rv_prof_stack *s) {
+  rv_u32 i = rv_prof_hash(s) & (size - 1);
+  while (tab[i].count && !rv_prof_same(tab + i, s))
+    i = (i + 1) & (size - 1);
+  return tab + i;
+}
+
+/* double the hash table, returns RV_BAD if out of memory */
+static rv_res rv_prof_grow(rv_prof *prof) {
+  rv_u32 size = prof->size ? prof->size * 2 : RV_PROF_SLOTS, x;
+  rv_prof_stack *tab = calloc(size, sizeof(*tab));
+  if (!tab)
+    return RV_BAD;
+  for (x = 0; x < prof->size; x++)
+    if (prof->tab[x].count)
+      *rv_prof_slot(tab, size, prof->tab + x) = prof->tab[x];
+  free(prof->tab);
+  prof->tab = tab, prof->size = size;
+  return RV_OK;
+}
+
+void rv_prof_add(rv_prof *prof, const rv_prof_stack *s) {
+  rv_prof_stack *slot;
+  if (prof->used * 2 >= prof->size && rv_prof_grow(prof) &&
+      prof->used + 1 >= prof->size) {
+    prof->dropped++; /* keep a free slot, or lookups never end */
+    return;
+  }
+  slot = rv_prof_slot(prof->tab, prof->size, s);
+  if (!slot->count)
+    *slot = *s, slot->count = 0, prof->used++;
+  slot->count++, prof->samples++;
+}
+
+static int rv_prof_symcmp(const void *a, const void *b) {
+  const rv_prof_sym *x = a, *y = b;
+  return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+rv_res rv_prof_elf(rv_prof *prof, const char *path) {
+  FILE *f = fopen(path, "rb");
+  rv_u8 *e = NULL /* file */, *sh /* section headers */, *tab, *str, *sym;
+  rv_u32 len = 0, shoff, shsize, shnum, x, y, n, stroff, strsize;
+  long end;
+  if (!f)
+    return RV_BAD;
+  if (!fseek(f, 0, SEEK_END) && (end = ftell(f)) >= 52 && end < 0x40000000 &&
+      !fseek(f, 0, SEEK_SET) && (e = malloc((size_t)end + 1)))
+    len = (rv_u32)fread(e, 1, (size_t)end, f);
+  fclose(f);
+  if (!e || len < 52 || memcmp(e, "\177ELF\1\1", 6)) /* 32-bit, LE */
+    return free(e), RV_BAD;
+  e[len] = 0; /* a truncated string table still ends */
+  shoff = rv_prof_u32(e + 32), shsize = rv_prof_u16(e + 46);
+  shnum = rv_prof_u16(e + 48), sh = e + shoff;
+  if (shsize < 40 || shoff > len || shnum > (len - shoff) / shsize)
+    return free(e), RV_BAD;
+  for (x = 0; x < shnum; x++) {
+    tab = sh + x * shsize;
+    if (rv_prof_u32(tab + 4) != 2 /* SHT_SYMTAB */ ||
+        rv_prof_u32(tab + 24) >= shnum)
+      continue;
+    str = sh + rv_prof_u32(tab + 24) * shsize; /* linked string table */
+    stroff = rv_prof_u32(str + 16), strsize = rv_prof_u32(str + 20);
+    if (rv_prof_u32(tab + 16) > len || stroff > len ||
+        strsize > len - stroff ||
+        rv_prof_u32(tab + 20) > len - rv_prof_u32(tab + 16))
+      continue;
+    n = rv_prof_u32(tab + 20) / 16;
+    free(prof->sym), prof->nsym = 0;
+    if (!(prof->sym = malloc(n * sizeof(*prof->sym) + 1)))
+      break;
+    for (y = 0; y < n; y++) {
+      sym = e + rv_prof_u32(tab + 16) + y * 16;
+      if ((sym[12] & 15) != 2 /* STT_FUNC */ || rv_prof_u32(sym) >= strsize)
+        continue;
+      prof->sym[prof->nsym].addr = rv_prof_u32(sym + 4);
+      prof->sym[prof->nsym].size = rv_prof_u32(sym + 8);
+      prof->sym[prof->nsym++].name = (char *)e + stroff + rv_prof_u32(sym);
+    }
+    break;
+  }
+  if (!prof->nsym)
+    return free(e), RV_BAD;
+  qsort(prof->sym, prof->nsym, sizeof(*prof->sym), &rv_prof_symcmp);
+  free(prof->elf);
+  prof->elf = (char *)e;
+  return RV_OK;
+}
+
+/* the symbol holding addr, or NULL */
+static const rv_prof_sym *rv_prof_find(rv_prof *prof, rv_u32 addr) {
+  rv_u32 lo = 0, hi = prof->nsym, mid;
+  const rv_prof_sym *s;
+  while (lo < hi) /* count the symbols at or below addr */
+    if (prof->sym[mid = lo + (hi - lo) / 2].addr <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  if (!lo)
+    return NULL;
+  s = prof->sym + lo - 1;
+  return !s->size || addr - s->addr < s->size ? s : NULL;
+}
+
+void rv_prof_write(rv_prof *prof, FILE *f) {
+  static const char *const privs[4] = {"user", "supervisor", "?", "machine"};
+  const rv_prof_sym *sym;
+  rv_u32 x, d;
+  for (x = 0; x < prof->size; x++) {
+    rv_prof_stack *s = prof->tab + x;
+    if (!s->count)
+      continue;
+    fprintf(f, "%s", privs[s->priv & 3]);
+    if (s->priv == RV_PUSER)
+      fprintf(f, "-%08lx", (unsigned long)s->satp);
+    for (d = s->depth; d--;) /* a return address may be past its caller's
+                                end, so look up the call before it */
+      if ((sym = rv_prof_find(prof, s->pc[d] - !!d)))
+        fprintf(f, ";%s", sym->name);
+      else
+        fprintf(f, ";0x%08lx", (unsigned long)s->pc[d]);
+    fprintf(f, " %lu\n", (unsigned long)s->count);
+  }
+}
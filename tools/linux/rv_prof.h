@@ -0,0 +1,56 @@
+/* Guest pc sampling profiler: counts distinct call stacks, unwound through
+ * frame pointers, and writes them as folded stacks for flamegraph.pl */
+
+#ifndef RV_PROF_H
+#define RV_PROF_H
+
+#include <stdio.h>
+
+#include "rv.h"
+
+#define RV_PROF_DEPTH 32 /* most frames kept per sample */
+
+/* a sampled call stack */
+typedef struct rv_prof_stack {
+  rv_u32 priv;              /* privilege level */
+  rv_u32 satp;              /* address space of user stacks, else 0 */
+  rv_u32 depth;             /* frames in pc */
+  rv_u32 count;             /* times sampled */
+  rv_u32 pc[RV_PROF_DEPTH]; /* pc, then return addresses, innermost first */
+} rv_prof_stack;
+
+/* a function symbol */
+typedef struct rv_prof_sym {
+  rv_u32 addr, size;
+  const char *name;
+} rv_prof_sym;
+
+typedef struct rv_prof {
+  rv_prof_stack *tab;      /* hash table of distinct stacks */
+  rv_u32 size, used;       /* slots (a power of 2) and slots in use */
+  rv_u32 samples, dropped; /* samples added, and lost for lack of memory */
+  rv_prof_sym *sym;        /* function symbols, by address */
+  rv_u32 nsym;
+  char *elf; /* contents of the ELF file, which hold the symbol names */
+} rv_prof;
+
+/* initialize the profiler with no samples or symbols */
+void rv_prof_init(rv_prof *prof);
+
+/* sample the pc of `cpu` and unwind its call stack into `s`, following the
+ * frame pointer (s0) through memory the cpu can `rv_peek` */
+void rv_prof_unwind(rv_prof_stack *s, rv *cpu);
+
+/* count a sampled stack */
+void rv_prof_add(rv_prof *prof, const rv_prof_stack *s);
+
+/* load the function symbols of the ELF32 file at `path`, to name frames.
+ * Returns RV_BAD if it can't be read or has no symbol table. */
+rv_res rv_prof_elf(rv_prof *prof, const char *path);
+
+/* write each stack as "root;outer;...;inner count", where root is the
+ * privilege level (with satp for user stacks) and frames are named by
+ * symbol, or by address if no symbol holds them */
+void rv_prof_write(rv_prof *prof, FILE *f);
+
+#endif /* RV_PROF_H */
@@ -0,0 +1,58 @@
+#include "rv_sched.h"
+
+#include <string.h>
+
+#define rv_sched_before(a, b) ((rv_s32)((a) - (b)) < 0) /* wrapping a < b */
+
+void rv_sched_init(rv_sched *sched) {
+  rv_u32 ev;
+  memset(sched, 0, sizeof(*sched));
+  for (ev = 0; ev < RV_SCHED_EVENTS; ev++)
+    sched->pos[ev] = RV_SCHED_NONE; /* not in the heap */
+}
+
+/* place event ev at heap index i */
+static void rv_sched_put(rv_sched *sched, rv_u32 i, rv_u32 ev) {
+  sched->heap[i] = ev, sched->pos[ev] = i;
+}
+
+/* restore the heap property for the event at index i */
+static void rv_sched_fix(rv_sched *sched, rv_u32 i) {
+  rv_u32 ev = sched->heap[i], c /* child */;
+  while (i && rv_sched_before(sched->when[ev],
+                              sched->when[sched->heap[(i - 1) / 2]]))
+    rv_sched_put(sched, i, sched->heap[(i - 1) / 2]), i = (i - 1) / 2;
+  while ((c = 2 * i + 1) < sched->n) {
+    if (c + 1 < sched->n && rv_sched_before(sched->when[sched->heap[c + 1]],
+                                            sched->when[sched->heap[c]]))
+      c++; /* earlier of the two children */
+    if (!rv_sched_before(sched->when[sched->heap[c]], sched->when[ev]))
+      break;
+    rv_sched_put(sched, i, sched->heap[c]), i = c;
+  }
+  rv_sched_put(sched, i, ev);
+}
+
+void rv_sched_set(rv_sched *sched, rv_u32 ev, rv_u32 when) {
+  sched->when[ev] = when;
+  if (sched->pos[ev] == RV_SCHED_NONE)
+    rv_sched_put(sched, sched->n++, ev);
+  rv_sched_fix(sched, sched->pos[ev]);
+}
+
+rv_u32 rv_sched_next(rv_sched *sched, rv_u32 *when) {
+  if (!sched->n)
+    return RV_SCHED_NONE;
+  *when = sched->when[sched->heap[0]];
+  return sched->heap[0];
+}
+
+rv_u32 rv_sched_pop(rv_sched *sched, rv_u32 now) {
+  rv_u32 ev = sched->heap[0];
+  if (!sched->n || rv_sched_before(now, sched->when[ev]))
+    return RV_SCHED_NONE; /* nothing is due */
+  sched->pos[ev] = RV_SCHED_NONE;
+  if (--sched->n)
+    rv_sched_put(sched, 0, sched->heap[sched->n]), rv_sched_fix(sched, 0);
+  return ev;
+}
@@ -0,0 +1,34 @@
+/* Discrete-event scheduler: a min-heap of device deadlines */
+
+#ifndef RV_SCHED_H
+#define RV_SCHED_H
+
+#include "rv.h"
+
+#define RV_SCHED_EVENTS 8           /* maximum number of event ids */
+#define RV_SCHED_NONE RV_SCHED_EVENTS /* no event is scheduled */
+
+/* Deadlines are in a wrapping 32-bit time, so they must be scheduled less
+ * than 2^31 ticks ahead. Each event id is scheduled at most once. */
+typedef struct rv_sched {
+  rv_u32 when[RV_SCHED_EVENTS]; /* deadline of each event id */
+  rv_u32 heap[RV_SCHED_EVENTS]; /* event ids, earliest deadline first */
+  rv_u32 pos[RV_SCHED_EVENTS];  /* index of each event id in heap */
+  rv_u32 n;                     /* number of scheduled events */
+} rv_sched;
+
+/* initialize the scheduler with no events */
+void rv_sched_init(rv_sched *sched);
+
+/* schedule event `ev` at `when`, moving it if it is already scheduled */
+void rv_sched_set(rv_sched *sched, rv_u32 ev, rv_u32 when);
+
+/* returns the earliest event and stores its deadline in *when, or returns
+ * RV_SCHED_NONE */
+rv_u32 rv_sched_next(rv_sched *sched, rv_u32 *when);
+
+/* unschedule the earliest event if it is due at `now`, and return it, or
+ * return RV_SCHED_NONE */
+rv_u32 rv_sched_pop(rv_sched *sched, rv_u32 now);
+
+#endif /* RV_SCHED_H */
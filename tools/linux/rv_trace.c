@@ -0,0 +1,162 @@
+#include "rv_trace.h"
+
+#include <string.h>
+
+/* flags leading a delta encoded record, each followed by its field */
+#define RV_TRACE_PC 1    /* pc isn't after the last instruction: zigzag delta */
+#define RV_TRACE_TRAP 2  /* a trap: its cause, then tval */
+#define RV_TRACE_INST 4  /* instruction not remembered at this pc */
+#define RV_TRACE_RD 8    /* rd changed: zigzag delta */
+#define RV_TRACE_ADDR 16 /* an address: zigzag delta from the last one */
+
+#define rv_trace_zig(x) ((x) << 1 ^ (0 - ((x) >> 31)))   /* signed -> varint */
+#define rv_trace_unzig(x) ((x) >> 1 ^ (0 - ((x) & 1))) /* varint -> signed */
+#define rv_trace_isz(i) (((i) & 3) == 3 ? 4 : 2)       /* instruction size */
+
+static void rv_trace_put(rv_trace_file *t, rv_u32 x) {
+  for (; x > 0x7F; x >>= 7)
+    putc((int)((x & 0x7F) | 0x80), t->f);
+  putc((int)x, t->f);
+}
+
+static rv_res rv_trace_get(rv_trace_file *t, rv_u32 *x) {
+  rv_u32 shift;
+  int c = 0x80;
+  for (*x = 0, shift = 0; c & 0x80 && shift < 35; shift += 7) {
+    if ((c = getc(t->f)) == EOF)
+      return RV_BAD;
+    *x |= (rv_u32)(c & 0x7F) << shift;
+  }
+  return c & 0x80 ? RV_BAD : RV_OK; /* too long */
+}
+
+/* the last instruction seen at pc */
+static rv_u32 *rv_trace_inst(rv_trace_hart *h, rv_u32 pc) {
+  return h->inst + (pc >> 1 & (RV_TRACE_CACHE - 1));
+}
+
+/* write r, encoded against the last record of hart h */
+static void rv_trace_enc(rv_trace_file *t, rv_trace_hart *h,
+                         const rv_trace_rec *r) {
+  rv_u32 x, flags = (r->pc != h->pc) * RV_TRACE_PC, w[4];
+  if (!t->delta) { /* four little-endian words */
+    w[0] = r->pc, w[1] = r->inst, w[2] = r->rd, w[3] = r->addr;
+    for (x = 0; x < 16; x++)
+      putc((int)(w[x / 4] >> x % 4 * 8 & 0xFF), t->f);
+    return;
+  }
+  if (!r->inst) { /* trap */
+    putc((int)(flags | RV_TRACE_TRAP), t->f);
+    if (flags)
+      rv_trace_put(t, rv_trace_zig(r->pc - h->pc));
+    rv_trace_put(t, r->rd), rv_trace_put(t, r->addr);
+    h->pc = r->pc; /* the handler's pc is encoded against the trap's */
+    return;
+  }
+  flags |= (*rv_trace_inst(h, r->pc) != r->inst) * RV_TRACE_INST |
+           (r->rd != h->rd) * RV_TRACE_RD | !!r->addr * RV_TRACE_ADDR;
+  putc((int)flags, t->f);
+  if (flags & RV_TRACE_PC)
+    rv_trace_put(t, rv_trace_zig(r->pc - h->pc));
+  if (flags & RV_TRACE_INST)
+    rv_trace_put(t, r->inst);
+  if (flags & RV_TRACE_RD)
+    rv_trace_put(t, rv_trace_zig(r->rd - h->rd));
+  if (flags & RV_TRACE_ADDR)
+    rv_trace_put(t, rv_trace_zig(r->addr - h->addr)), h->addr = r->addr;
+  *rv_trace_inst(h, r->pc) = r->inst, h->rd = r->rd;
+  h->pc = r->pc + rv_trace_isz(r->inst);
+}
+
+/* read a record encoded against the last record of hart h */
+static rv_res rv_trace_dec(rv_trace_file *t, rv_trace_hart *h,
+                           rv_trace_rec *r) {
+  rv_u32 x, flags, d = 0, w[4] = {0};
+  int c;
+  if (!t->delta) {
+    for (x = 0; x < 16; x++) {
+      if ((c = getc(t->f)) == EOF)
+        return RV_BAD;
+      w[x / 4] |= (rv_u32)c << x % 4 * 8;
+    }
+    r->pc = w[0], r->inst = w[1], r->rd = w[2], r->addr = w[3];
+    return RV_OK;
+  }
+  if ((c = getc(t->f)) == EOF)
+    return RV_BAD;
+  flags = (rv_u32)c;
+  if (flags & RV_TRACE_PC && rv_trace_get(t, &d))
+    return RV_BAD;
+  r->pc = h->pc + rv_trace_unzig(d);
+  if (flags & RV_TRACE_TRAP) {
+    r->inst = 0, h->pc = r->pc;
+    return rv_trace_get(t, &r->rd) || rv_trace_get(t, &r->addr) ? RV_BAD
+                                                               : RV_OK;
+  }
+  r->inst = *rv_trace_inst(h, r->pc), r->rd = h->rd, r->addr = 0;
+  if (flags & RV_TRACE_INST && rv_trace_get(t, &r->inst))
+    return RV_BAD;
+  if (flags & RV_TRACE_RD && rv_trace_get(t, &d))
+    return RV_BAD;
+  r->rd += flags & RV_TRACE_RD ? rv_trace_unzig(d) : 0;
+  if (flags & RV_TRACE_ADDR && rv_trace_get(t, &d))
+    return RV_BAD;
+  if (flags & RV_TRACE_ADDR)
+    r->addr = h->addr += rv_trace_unzig(d);
+  if (!r->inst)
+    return RV_BAD; /* an instruction never seen at this pc */
+  *rv_trace_inst(h, r->pc) = r->inst, h->rd = r->rd;
+  h->pc = r->pc + rv_trace_isz(r->inst);
+  return RV_OK;
+}
+
+rv_res rv_trace_create(rv_trace_file *t, const char *path, int delta) {
+  memset(t, 0, sizeof(*t));
+  if (!(t->f = fopen(path, "wb")))
+    return RV_BAD;
+  t->delta = delta;
+  fputs(RV_TRACE_MAGIC, t->f);
+  putc(delta ? 'd' : 'r', t->f);
+  return RV_OK;
+}
+
+rv_u32 rv_trace_drain(rv_trace_file *t, rv_u32 hart, rv_trace *ring) {
+  rv_u32 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  rv_u32 tail = ring->tail, n, moved = 0;
+  while (head != tail) { /* chunks keep harts apart */
+    n = head - tail > RV_TRACE_CHUNK ? RV_TRACE_CHUNK : head - tail;
+    rv_trace_put(t, hart), rv_trace_put(t, n), moved += n;
+    for (; n; n--, tail++)
+      rv_trace_enc(t, t->st + hart, ring->rec + (tail & ring->mask));
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE); /* free them */
+  }
+  return moved;
+}
+
+rv_res rv_trace_open(rv_trace_file *t, const char *path) {
+  char magic[sizeof(RV_TRACE_MAGIC)];
+  memset(t, 0, sizeof(*t));
+  if (!(t->f = fopen(path, "rb")))
+    return RV_BAD;
+  if (fread(magic, 1, sizeof(magic), t->f) != sizeof(magic) ||
+      memcmp(magic, RV_TRACE_MAGIC, sizeof(magic) - 1) ||
+      (magic[sizeof(magic) - 1] != 'r' && magic[sizeof(magic) - 1] != 'd'))
+    return rv_trace_close(t), RV_BAD;
+  t->delta = magic[sizeof(magic) - 1] == 'd';
+  return RV_OK;
+}
+
+rv_res rv_trace_read(rv_trace_file *t, rv_u32 *hart, rv_trace_rec *r) {
+  while (!t->left) /* next chunk */
+    if (rv_trace_get(t, &t->hart) || rv_trace_get(t, &t->left) ||
+        t->hart >= RV_TRACE_HARTS)
+      return RV_BAD;
+  t->left--, *hart = t->hart;
+  return rv_trace_dec(t, t->st + t->hart, r);
+}
+
+void rv_trace_close(rv_trace_file *t) {
+  if (t->f)
+    fclose(t->f);
+  t->f = NULL;
+}
@@ -0,0 +1,48 @@
+/* Execution trace files: records drained from the trace rings of harts built
+ * with RV_TRACE, as raw records or delta/varint encoded */
+
+#ifndef RV_TRACE_H
+#define RV_TRACE_H
+
+#include <stdio.h>
+
+#include "rv.h"
+
+#define RV_TRACE_HARTS 8     /* most harts in a trace */
+#define RV_TRACE_CACHE 1024  /* instructions remembered per hart, by pc */
+#define RV_TRACE_CHUNK 4096  /* most records per chunk */
+#define RV_TRACE_MAGIC "rvtrace" /* followed by 'r' (raw) or 'd' (delta) */
+
+/* a hart's last record, which the next is encoded against */
+typedef struct rv_trace_hart {
+  rv_u32 pc;                   /* pc the next record is expected at */
+  rv_u32 rd, addr;             /* last rd value and last nonzero address */
+  rv_u32 inst[RV_TRACE_CACHE]; /* last instruction seen at each pc */
+} rv_trace_hart;
+
+typedef struct rv_trace_file {
+  FILE *f;
+  int delta;         /* records are delta/varint encoded, otherwise raw */
+  rv_u32 hart, left; /* reading: hart of this chunk and records left in it */
+  rv_trace_hart st[RV_TRACE_HARTS];
+} rv_trace_file;
+
+/* create the trace file at `path`, delta encoded if `delta` is nonzero.
+ * Returns RV_BAD if it can't be created. */
+rv_res rv_trace_create(rv_trace_file *t, const char *path, int delta);
+
+/* move the records in `ring`, hart `hart`'s trace ring, to the file. Call
+ * this from one consumer thread only. Returns the number of records moved. */
+rv_u32 rv_trace_drain(rv_trace_file *t, rv_u32 hart, rv_trace *ring);
+
+/* open the trace file at `path` for reading. Returns RV_BAD if it can't be
+ * opened or isn't a trace. */
+rv_res rv_trace_open(rv_trace_file *t, const char *path);
+
+/* read the next record and the hart it came from. Returns RV_BAD at the end
+ * of the file, or if it is corrupt. */
+rv_res rv_trace_read(rv_trace_file *t, rv_u32 *hart, rv_trace_rec *r);
+
+void rv_trace_close(rv_trace_file *t);
+
+#endif /* RV_TRACE_H */
@@ -29,8 +29,9 @@ void rv_uart_init(rv_uart *uart, void *user, rv_uart_cb cb) {
   rv_uart_fifo_init(&uart->rx);
 }
 
-rv_res rv_uart_bus(rv_uart *uart, rv_u32 addr, rv_u8 *d, rv_u32 is_store,
+rv_res rv_uart_bus(void *user, rv_u32 addr, rv_u8 *d, rv_u32 is_store,
                    rv_u32 width) {
+  rv_uart *uart = (rv_uart *)user;
   rv_u32 data;
   rv_endcvt(d, (rv_u8 *)&data, 4, 0);
   if (width != 4)
@@ -76,9 +77,9 @@ rv_res rv_uart_bus(rv_uart *uart, rv_u32 addr, rv_u8 *d, rv_u32 is_store,
   return RV_OK;
 }
 
-rv_u32 rv_uart_update(rv_uart *uart) {
+rv_u32 rv_uart_update(rv_uart *uart, rv_u32 clocks) {
   rv_u8 byte = uart->tx.buf[uart->tx.read];
-  if (++uart->clk >= uart->div) {
+  if ((uart->clk += clocks) >= uart->div) {
     if ((uart->txctrl & 1) && uart->tx.size &&
         (uart->cb(uart->user, &byte, 1) == RV_OK))
       rv_uart_fifo_get(&uart->tx);
@@ -97,3 +98,7 @@ rv_u32 rv_uart_update(rv_uart *uart) {
     uart->ip &= ~(2U);
   return !!uart->ip;
 }
+
+rv_u32 rv_uart_next(rv_uart *uart) {
+  return uart->div > uart->clk ? uart->div - uart->clk : 1;
+}
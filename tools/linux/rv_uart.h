@@ -29,11 +29,15 @@ void rv_uart_init(rv_uart *uart, void *user, rv_uart_cb cb);
 
 #define RV_UART_SIZE /* size of memory map */ 0x20
 
-/* perform a bus access on the UART */
-rv_res rv_uart_bus(rv_uart *uart, rv_u32 addr, rv_u8 *data, rv_u32 is_store,
+/* perform a bus access on the UART, `user` is the rv_uart */
+rv_res rv_uart_bus(void *user, rv_u32 addr, rv_u8 *data, rv_u32 is_store,
                    rv_u32 width);
 
-/* update the UART */
-rv_u32 rv_uart_update(rv_uart *uart);
+/* advance the UART by `clocks` clocks, transferring at most one byte each way
+ * once `div` clocks have passed, and returns the interrupt pending status */
+rv_u32 rv_uart_update(rv_uart *uart, rv_u32 clocks);
+
+/* returns the number of clocks until the UART's next transfer */
+rv_u32 rv_uart_next(rv_uart *uart);
 
 #endif
@@ -0,0 +1,169 @@
+/* rvtrace: print an execution trace written by `mach-trace -x` in the style
+ * of `objdump -D -M no-aliases -M numeric`, with each instruction's rd value
+ * and data address. Compressed instructions are shown as their expansion. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rv_trace.h"
+
+#define rd(i) ((unsigned)((i) >> 7 & 31)) /* instruction fields, for printf */
+#define rs1(i) ((unsigned)((i) >> 15 & 31))
+#define rs2(i) ((unsigned)((i) >> 20 & 31))
+#define f3(i) ((unsigned)((i) >> 12 & 7))
+#define f7(i) ((unsigned)((i) >> 25))
+
+/* sign-extend the low `bits` bits of x */
+static long sext(rv_u32 x, int bits) {
+  x &= (1UL << bits) - 1;
+  return x >> (bits - 1) ? (long)x - (1L << bits) : (long)x;
+}
+
+#define imm_i(i) sext((i) >> 20, 12)
+#define imm_s(i) sext(f7(i) << 5 | rd(i), 12)
+#define imm_b(i)                                                               \
+  sext((i) >> 31 << 12 | ((i) >> 7 & 1) << 11 | ((i) >> 25 & 63) << 5 |        \
+           ((i) >> 8 & 15) << 1,                                               \
+       13)
+#define imm_j(i)                                                               \
+  sext((i) >> 31 << 20 | ((i) >> 12 & 255) << 12 | ((i) >> 20 & 1) << 11 |     \
+           ((i) >> 21 & 1023) << 1,                                            \
+       21)
+
+/* print the fence set in the low 4 bits of x */
+static char *fence_set(char *s, rv_u32 x) {
+  char *p = s;
+  rv_u32 b;
+  for (b = 0; b < 4; b++)
+    if (x >> (3 - b) & 1)
+      *p++ = "iorw"[b];
+  strcpy(p, p == s ? "0" : "");
+  return s;
+}
+
+/* disassemble the 32-bit instruction i at pc into s, returns nonzero if it
+ * writes rd */
+static int dis(char *s, rv_u32 pc, rv_u32 i) {
+  static const char *const ld[8] = {"lb", "lh", "lw", 0, "lbu", "lhu", 0, 0};
+  static const char *const st[8] = {"sb", "sh", "sw", 0, 0, 0, 0, 0};
+  static const char *const opi[8] = {"addi", "slli", "slti", "sltiu",
+                                     "xori", "srli", "ori",  "andi"};
+  static const char *const op[8] = {"add", "sll", "slt", "sltu",
+                                    "xor", "srl", "or",  "and"};
+  static const char *const mul[8] = {"mul", "mulh", "mulhsu", "mulhu",
+                                     "div", "divu", "rem",    "remu"};
+  static const char *const br[8] = {"beq", "bne", 0,      0,
+                                    "blt", "bge", "bltu", "bgeu"};
+  static const char *const amo[32] = {/* by funct5 */
+      "amoadd",  "amoswap", "lr", "sc", "amoxor",  0, 0, 0,
+      "amoor",   0,         0,    0,    "amoand",  0, 0, 0,
+      "amomin",  0,         0,    0,    "amomax",  0, 0, 0,
+      "amominu", 0,         0,    0,    "amomaxu", 0, 0, 0};
+  static const char *const aqrl[4] = {"", ".rl", ".aq", ".aqrl"};
+  static const char *const csr[8] = {0,       "csrrw",  "csrrs",  "csrrc",
+                                     0,       "csrrwi", "csrrsi", "csrrci"};
+  rv_u32 o = i >> 2 & 31, f = f3(i);
+  char a[8], b[8];
+  const char *name;
+  if (o == 0 && ld[f]) {
+    sprintf(s, "%s\tx%u,%ld(x%u)", ld[f], rd(i), imm_i(i), rs1(i));
+  } else if (o == 8 && st[f]) {
+    sprintf(s, "%s\tx%u,%ld(x%u)", st[f], rs2(i), imm_s(i), rs1(i));
+    return 0;
+  } else if (o == 4 && (f == 1 || f == 5)) {
+    sprintf(s, "%s\tx%u,x%u,0x%x", f7(i) & 32 ? "srai" : opi[f], rd(i), rs1(i),
+            rs2(i));
+  } else if (o == 4) {
+    sprintf(s, "%s\tx%u,x%u,%ld", opi[f], rd(i), rs1(i), imm_i(i));
+  } else if (o == 12 && (!f7(i) || (f7(i) == 32 && (f == 0 || f == 5)) ||
+                         f7(i) == 1)) {
+    name = f7(i) == 1 ? mul[f] : f7(i) ? (f ? "sra" : "sub") : op[f];
+    sprintf(s, "%s\tx%u,x%u,x%u", name, rd(i), rs1(i), rs2(i));
+  } else if (o == 5 || o == 13) {
+    sprintf(s, "%s\tx%u,0x%lx", o == 5 ? "auipc" : "lui", rd(i),
+            (unsigned long)(i >> 12));
+  } else if (o == 24 && br[f]) {
+    sprintf(s, "%s\tx%u,x%u,%lx", br[f], rs1(i), rs2(i),
+            (unsigned long)(pc + (rv_u32)imm_b(i)));
+    return 0;
+  } else if (o == 25 && !f) {
+    sprintf(s, "jalr\tx%u,%ld(x%u)", rd(i), imm_i(i), rs1(i));
+  } else if (o == 27) {
+    sprintf(s, "jal\tx%u,%lx", rd(i), (unsigned long)(pc + (rv_u32)imm_j(i)));
+  } else if (o == 11 && f == 2 && (name = amo[i >> 27])) {
+    if (i >> 27 == 2)
+      sprintf(s, "lr.w%s\tx%u,(x%u)", aqrl[i >> 25 & 3], rd(i), rs1(i));
+    else
+      sprintf(s, "%s.w%s\tx%u,x%u,(x%u)", name, aqrl[i >> 25 & 3], rd(i),
+              rs2(i), rs1(i));
+  } else if (o == 3 && f == 0) {
+    sprintf(s, "fence\t%s,%s", fence_set(a, i >> 24), fence_set(b, i >> 20));
+    return 0;
+  } else if (o == 3 && f == 1) {
+    strcpy(s, "fence.i");
+    return 0;
+  } else if (o == 28 && csr[f]) {
+    sprintf(s, f & 4 ? "%s\tx%u,0x%x,%u" : "%s\tx%u,0x%x,x%u", csr[f], rd(i),
+            (unsigned)(i >> 20), rs1(i));
+  } else if (o == 28 && !f && f7(i) == 9 && !rd(i)) {
+    sprintf(s, "sfence.vma\tx%u,x%u", rs1(i), rs2(i));
+    return 0;
+  } else if (i == 0x73 || i == 0x100073 || i == 0x10200073 ||
+             i == 0x30200073 || i == 0x10500073) {
+    strcpy(s, i == 0x73         ? "ecall"
+              : i == 0x100073   ? "ebreak"
+              : i == 0x10200073 ? "sret"
+              : i == 0x30200073 ? "mret"
+                                : "wfi");
+    return 0;
+  } else {
+    sprintf(s, ".4byte\t0x%lx", (unsigned long)i);
+    return 0;
+  }
+  return rd(i) != 0;
+}
+
+int main(int argc, char **argv) {
+  rv_trace_file t;
+  rv_trace_rec r;
+  rv_u32 hart, want = argc > 2 ? (rv_u32)atol(argv[2]) : 0, i;
+  unsigned long n = 0;
+  char hex[16], text[64];
+  if (argc < 2 || argc > 3) {
+    printf("usage: rvtrace trace [hart]\n");
+    return EXIT_FAILURE;
+  }
+  if (rv_trace_open(&t, argv[1])) {
+    printf("unable to read trace %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  while (!rv_trace_read(&t, &hart, &r)) {
+    n++;
+    if (hart != want)
+      continue;
+    if (!r.inst) {
+      printf("%8lx:\t%-18s\t<%s %lu>\ttval 0x%lx\n", (unsigned long)r.pc,
+             "trap", r.rd >> 31 ? "interrupt" : "exception",
+             (unsigned long)(r.rd & 0x7FFFFFFF), (unsigned long)r.addr);
+      continue;
+    }
+    sprintf(hex, (r.inst & 3) == 3 ? "%08lx" : "%04lx", (unsigned long)r.inst);
+    i = (r.inst & 3) == 3 ? r.inst : rv_decompress(r.inst);
+    printf("%8lx:\t%-18s\t", (unsigned long)r.pc, hex);
+    if (!i) {
+      printf(".2byte\t0x%lx\n", (unsigned long)r.inst);
+      continue;
+    }
+    if (dis(text, r.pc, i))
+      printf("%-28s# x%u=%08lx", text, rd(i), (unsigned long)r.rd);
+    else
+      printf("%s", text);
+    if (r.addr)
+      printf(" @%08lx", (unsigned long)r.addr);
+    printf("\n");
+  }
+  rv_trace_close(&t);
+  fprintf(stderr, "%lu records\n", n);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,23 @@
+import glob
+import subprocess
+import sys
+import time
+
+# usage: python bench.py <run_test binary>...
+# runs every test vector repeatedly with each binary and reports MIPS
+
+REPS = "200"
+LIMIT = "10000000"
+
+tests = sorted([x for x in glob.glob("vectors/*") if not x.endswith(".dmp")])
+
+for binary in sys.argv[1:]:
+    ninstr, elapsed = 0, 0.0
+    for test in tests:
+        start = time.perf_counter()
+        p = subprocess.run([binary, test, LIMIT, REPS], capture_output=True)
+        elapsed += time.perf_counter() - start
+        if p.returncode == 0:
+            ninstr += int(p.stdout)
+    print(f"{binary}: {ninstr} instructions in {elapsed:.3f}s", end="")
+    print(f" ({ninstr / elapsed / 1e6:.2f} MIPS)")
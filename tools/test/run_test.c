@@ -38,31 +38,52 @@ void dump_cpu(rv *r) {
   printf("priv:    %8X\n", r->priv);
 }
 
+/* run a loaded test, returns 1 if it passed */
+int run(rv *cpu, unsigned long limit, unsigned long *ninstr) {
+  unsigned long n = 0;
+  while (!limit || n < limit) {
+    rv_u32 v, ran, budget = 4096;
+    if (limit && limit - n < budget)
+      budget = (rv_u32)(limit - n);
+    v = rv_run(cpu, budget, &ran), n += ran, *ninstr += ran;
+    if ((v == RV_EUECALL || v == RV_ESECALL || v == RV_EMECALL) &&
+        (cpu->r[3] == 1 && cpu->r[10] == 0))
+      return 1;
+  }
+  return 0;
+}
+
 int main(int argc, const char **argv) {
   FILE *f;
   rv cpu;
-  unsigned long limit = 0, ninstr = 0;
+  static rv_u8 image[sizeof(mem)];
+  unsigned long limit = 0, reps = 1, i, ninstr = 0;
+  char *end;
   if (argc < 2)
     die("expected test name");
   f = fopen(argv[1], "r");
   if (!f)
     die("couldn't open test");
-  if (argc == 3) {
-    char *end;
+  if (argc >= 3) {
     limit = strtoul(argv[2], &end, 10);
     if (!limit)
       die("invalid number of instructions");
   }
-  (void)argc;
-  memset(mem, 0, sizeof(mem));
-  fread(mem, 1, sizeof(mem), f);
-  rv_init(&cpu, NULL, &bus_cb);
-  while (1 && (!limit || ninstr++ < limit)) {
-    rv_u32 v = rv_step(&cpu);
-    if ((v == RV_EUECALL || v == RV_ESECALL || v == RV_EMECALL) &&
-        (cpu.r[3] == 1 && cpu.r[10] == 0))
-      return EXIT_SUCCESS;
+  if (argc >= 4) { /* benchmark: run the test `reps` times */
+    reps = strtoul(argv[3], &end, 10);
+    if (!reps)
+      die("invalid number of repetitions");
+  }
+  fread(image, 1, sizeof(image), f);
+  for (i = 0; i < reps; i++) {
+    memcpy(mem, image, sizeof(mem));
+    rv_init(&cpu, NULL, &bus_cb);
+    if (!run(&cpu, limit, &ninstr)) {
+      dump_cpu(&cpu);
+      return EXIT_FAILURE;
+    }
   }
-  dump_cpu(&cpu);
-  return EXIT_FAILURE;
+  if (argc >= 4)
+    printf("%lu\n", ninstr);
+  return EXIT_SUCCESS;
 }